@@ -6,6 +6,19 @@
 #include <bit>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <tuple>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <list>
+#include <chrono>
+#include <array>
+#include <cstring>
+#include <cerrno>
+#include <coroutine>
+#include <deque>
 using memory_order = std::memory_order;
 
 // throw/std::runtime_error was a mistake
@@ -30,30 +43,456 @@ using memory_order = std::memory_order;
 #endif
 #endif
 
-class AllocDB{
+// Block compression, an LZ4-style format: sequences of [token] [literal length...] [literals] [offset:16 LE] [match length...], where the token holds 4 bits each of the literal length and the match length minus 4 (15 meaning more length bytes follow, each adding up to 255)
+// The last sequence has only literals. Tuned for speed over ratio: greedy matching with a single hash table probe
+// Returns the compressed size, or 0 if it would not fit in `cap`
+static size_t lz_compress(const char* src, size_t n, char* dst, size_t cap){
+	constexpr int HASH_BITS = 14;
+	const uint8_t* in = (const uint8_t*) src;
+	uint8_t* out = (uint8_t*) dst;
+	uint8_t* out_end = out + cap;
+	auto load32 = [&](size_t i){ uint32_t v; memcpy(&v, in + i, 4); return v; };
+	auto put_len = [&](size_t len){
+		for(; len >= 255; len -= 255) *out++ = 255;
+		*out++ = uint8_t(len);
+	};
+	auto emit = [&](const uint8_t* lit, size_t lit_len, size_t match_len, size_t offset){
+		if(size_t(out_end - out) < 1 + lit_len/255 + 1 + lit_len + 2 + match_len/255 + 1) return false;
+		uint8_t* token = out++;
+		*token = uint8_t(std::min<size_t>(lit_len, 15) << 4);
+		if(lit_len >= 15) put_len(lit_len - 15);
+		memcpy(out, lit, lit_len);
+		out += lit_len;
+		if(match_len){
+			*out++ = uint8_t(offset);
+			*out++ = uint8_t(offset >> 8);
+			*token |= uint8_t(std::min<size_t>(match_len - 4, 15));
+			if(match_len - 4 >= 15) put_len(match_len - 4 - 15);
+		}
+		return true;
+	};
+	// Kept per thread, it costs as much to allocate as compressing a small block
+	static thread_local std::unique_ptr<uint32_t[]> table(new uint32_t[1 << HASH_BITS]);
+	memset(table.get(), 0, sizeof(uint32_t) << HASH_BITS);
+	size_t i = 1, anchor = 0, misses = 0;
+	// Matches neither start in nor cover the last 12 bytes, so matching can always read a whole word ahead
+	for(size_t limit = n > 12 ? n - 12 : 0; i < limit;){
+		uint32_t v = load32(i), h = v * 2654435761u >> (32 - HASH_BITS);
+		size_t cand = table[h];
+		table[h] = uint32_t(i);
+		if(i - cand > 0xFFFF || load32(cand) != v){
+			// Skip ahead faster the longer nothing matches, as the data is probably incompressible
+			i += 1 + (misses++ >> 5);
+			continue;
+		}
+		misses = 0;
+		while(i > anchor && cand && in[i-1] == in[cand-1]){ i--; cand--; }
+		size_t len = 4;
+		while(i + len + 8 <= n - 5){
+			uint64_t a, b;
+			memcpy(&a, in + i + len, 8);
+			memcpy(&b, in + cand + len, 8);
+			if(a != b){
+				len += std::countr_zero(a ^ b) >> 3;
+				break;
+			}
+			len += 8;
+		}
+		if(!emit(in + anchor, i - anchor, len, i - cand)) return 0;
+		i += len;
+		anchor = i;
+	}
+	return emit(in + anchor, n - anchor, 0, 0) ? out - (uint8_t*) dst : 0;
+}
+// Returns the decompressed size, or -1 if the input is malformed or would decompress to more than `cap` bytes
+static size_t lz_decompress(const char* src, size_t n, char* dst, size_t cap){
+	const uint8_t* in = (const uint8_t*) src;
+	const uint8_t* in_end = in + n;
+	uint8_t* out = (uint8_t*) dst;
+	uint8_t* out_end = out + cap;
+	auto get_len = [&](size_t& len){
+		uint8_t b;
+		do{
+			if(in == in_end) return false;
+			len += b = *in++;
+		}while(b == 255);
+		return true;
+	};
+	while(in < in_end){
+		uint8_t token = *in++;
+		size_t lit = token >> 4, match = token & 15;
+		if(lit == 15 && !get_len(lit)) return -1;
+		if(lit > size_t(in_end - in) || lit > size_t(out_end - out)) return -1;
+		// Short copies are done as one fixed size copy where there is room to overshoot, which is much faster than a variable one
+		if(lit <= 16 && in_end - in >= 16 && out_end - out >= 16) memcpy(out, in, 16);
+		else memcpy(out, in, lit);
+		in += lit;
+		out += lit;
+		if(in == in_end) break;
+		if(in_end - in < 2) return -1;
+		size_t offset = in[0] | in[1] << 8;
+		in += 2;
+		if(match == 15 && !get_len(match)) return -1;
+		match += 4;
+		if(!offset || offset > size_t(out - (uint8_t*) dst) || match > size_t(out_end - out)) return -1;
+		const uint8_t* from = out - offset;
+		// Overlapping matches repeat the last `offset` bytes, so they are copied forwards, 8 bytes at a time if that never reads what it hasn't written yet
+		if(offset >= 8 && size_t(out_end - out) >= match + 8) for(size_t k = 0; k < match; k += 8) memcpy(out + k, from + k, 8);
+		else if(offset >= match) memcpy(out, from, match);
+		else for(size_t k = 0; k < match; k++) out[k] = from[k];
+		out += match;
+	}
+	return out - (uint8_t*) dst;
+}
 
-	// Up to 256, allows allocations up to 2^(MAX_BUCKETS/4) * SMALLEST_BUCKET
-	static constexpr int MAX_BUCKETS = 160;
+// Size class geometry, see BasicAllocDB
+// Every doubling of block size is split into 2^STEP_BITS evenly spaced buckets. Fewer steps mean fewer files and less metadata, more steps mean less internal fragmentation (at most 1/2^STEP_BITS)
+// BUCKET0_OFFSET==8, STEP_BITS==2 => SMALLEST_BUCKET==1024
+// We encode the bucket # on the lowest 8 bits of block pointers, so block sizes and thus BUCKET0_OFFSET must be at least 8 (multiples of 256) unless you change how the bucket # is encoded
+// MAX_BUCKETS allows allocations up to 2^(MAX_BUCKETS >> STEP_BITS) * SMALLEST_BUCKET. The bucket #s and small object tags must fit below 250, the tags used by records in the frees file, journal and batch log
+// Objects of up to SMALL_MAX bytes are packed into slabs (0 disables it). That needs SMALLEST_BUCKET to be at least 1024
+template<int STEP_BITS_ = 2, int BUCKET0_OFFSET_ = 8, int MAX_BUCKETS_ = 160, int SMALL_MAX_ = 512>
+struct BucketGeometry{
+	static constexpr int STEP_BITS = STEP_BITS_, BUCKET0_OFFSET = BUCKET0_OFFSET_, MAX_BUCKETS = MAX_BUCKETS_, SMALL_MAX = SMALL_MAX_;
+};
+// The default: 4 buckets per doubling from 1024 bytes, up to 2^40 KiB
+using DefaultGeometry = BucketGeometry<>;
+// 2 buckets per doubling from 4096 bytes and no small object tier, for blob storage
+using BlobGeometry = BucketGeometry<1, 11, 80, 0>;
+// 8 buckets per doubling from 2048 bytes, for records. At most 12.5% internal fragmentation instead of 25%
+using RecordGeometry = BucketGeometry<3, 8, 240, 512>;
 
-	// BUCKET0_OFFSET==8 => SMALLEST_BUCKET==1024
-	// We encode the bucket # on the lowest 8 bits of block pointers so don't set this to lower than 8 unless you change how the bucket # is encoded
-	static constexpr int BUCKET0_OFFSET = 8;
+// AllocDB with a compile time size class geometry. All bucket math is constexpr and specialized per geometry
+// Databases are not portable across geometries, bucket #s mean different block sizes in each
+template<typename Geometry = DefaultGeometry>
+class BasicAllocDB{
+
+	static constexpr int MAX_BUCKETS = Geometry::MAX_BUCKETS;
+	static constexpr int BUCKET0_OFFSET = Geometry::BUCKET0_OFFSET;
+	static constexpr int STEP_BITS = Geometry::STEP_BITS;
 	// minimum allocation size, i.e size of blocks in bucket 0
-	static constexpr int SMALLEST_BUCKET = 4 << BUCKET0_OFFSET;
+	static constexpr int SMALLEST_BUCKET = 1 << STEP_BITS << BUCKET0_OFFSET;
+	// Block sizes must stay clear of USED_BIT
+	static_assert(BUCKET0_OFFSET >= 8 && STEP_BITS >= 0 && MAX_BUCKETS > 0 && (MAX_BUCKETS >> STEP_BITS) + STEP_BITS + BUCKET0_OFFSET < 63);
+
+	// Size of blocks in a bucket
+	static constexpr uint64_t bucket_size(int bucket){
+		return uint64_t(SMALLEST_BUCKET | (bucket & ((1 << STEP_BITS) - 1)) << BUCKET0_OFFSET) << (bucket >> STEP_BITS);
+	}
 
-	struct Bucket: std::mutex{
+	// A shared mapping of the first `pages` pages of a bucket file
+	// When a bucket needs a bigger mapping, the old one is kept alive (via prev) until the db is destroyed so views into it stay valid
+	struct Map{
+		char* base;
+		size_t pages;
+		Map* prev;
+	};
+	// A file of one u64 entry per block, accessed through a shared mapping that is only ever grown, under `lock`. That lock is never held while taking another
+	struct SideTable{
 		file_t fd = X_FILE_T_INVALID;
-		uint64_t end = 0;
-		std::vector<uint64_t> free;
-		bool check_init(std::string& prefix, int bucket){
-			if(fd == X_FILE_T_INVALID){
-				std::string name = prefix + "/" + std::to_string(bucket);
-				if((fd = x_open(name.c_str())) == X_FILE_T_INVALID)
+		std::atomic<Map*> map = 0;
+		std::mutex lock;
+	};
+	// A set of block indexes as a bitmap, with summary levels above it of one bit per non-empty word below, up to a single word
+	// Finding the lowest or highest member, or the next one from an index, takes one countr_zero() per level
+	struct BitTree{
+		std::vector<std::vector<uint64_t>> lv = {{}};
+		uint64_t count = 0;
+		size_t words() const{ return lv[0].size(); }
+		bool test(uint64_t i) const{ return (i >> 6) < words() && (lv[0][i >> 6] >> (i & 63) & 1); }
+		// Recompute the summary levels from the bitmap
+		void rebuild(){
+			lv.resize(1);
+			while(lv.back().size() > 1){
+				std::vector<uint64_t> up((lv.back().size() + 63) >> 6);
+				for(size_t j = 0; j < lv.back().size(); j++) if(lv.back()[j]) up[j >> 6] |= uint64_t(1) << (j & 63);
+				lv.push_back(std::move(up));
+			}
+		}
+		// Make room for indexes below n. Grows geometrically, so rebuilding is amortized
+		void reserve(uint64_t n){
+			size_t w = (n + 63) >> 6;
+			if(w <= words()) return;
+			lv[0].resize(std::max(w, words() * 2));
+			rebuild();
+		}
+		// Return false if i was already a member
+		bool set(uint64_t i){
+			reserve(i + 1);
+			if(test(i)) return false;
+			for(size_t k = 0; k < lv.size(); k++, i >>= 6){
+				uint64_t& w = lv[k][i >> 6];
+				bool was = w;
+				w |= uint64_t(1) << (i & 63);
+				if(was) break;
+			}
+			count++;
+			return true;
+		}
+		// Return false if i was not a member
+		bool clear(uint64_t i){
+			if(!test(i)) return false;
+			for(size_t k = 0; k < lv.size(); k++, i >>= 6){
+				uint64_t& w = lv[k][i >> 6];
+				w &= ~(uint64_t(1) << (i & 63));
+				if(w) break;
+			}
+			count--;
+			return true;
+		}
+		// Lowest member >= i, or -1
+		uint64_t next(uint64_t i) const{
+			for(size_t k = 0; k < lv.size(); k++){
+				uint64_t w = i >> 6;
+				if(w >= lv[k].size()) return -1;
+				uint64_t bits = lv[k][w] & (~uint64_t(0) << (i & 63));
+				if(bits){
+					i = w << 6 | std::countr_zero(bits);
+					while(k--) i = i << 6 | std::countr_zero(lv[k][i]);
+					return i;
+				}
+				i = w + 1;
+			}
+			return -1;
+		}
+		// Lowest non-member >= i
+		uint64_t next_clear(uint64_t i) const{
+			uint64_t w = i >> 6;
+			if(w >= words()) return i;
+			uint64_t bits = ~lv[0][w] & (~uint64_t(0) << (i & 63));
+			while(!bits && ++w < words()) bits = ~lv[0][w];
+			return bits ? w << 6 | std::countr_zero(bits) : words() << 6;
+		}
+		// Lowest i such that i..i+n-1 are all members, or -1
+		uint64_t find_run(uint64_t n) const{
+			for(uint64_t i = next(0); i != uint64_t(-1); i = next(i)){
+				uint64_t e = next_clear(i);
+				if(e - i >= n) return i;
+				i = e;
+			}
+			return -1;
+		}
+		// Highest member, or -1
+		uint64_t last() const{
+			if(!count) return -1;
+			uint64_t i = 0;
+			for(size_t k = lv.size(); k--;) i = i << 6 | (63 - std::countl_zero(lv[k][i]));
+			return i;
+		}
+		// Add every bit of network-endian bitmap words
+		void merge(const uint64_t* bits, size_t n){
+			reserve(n << 6);
+			count = 0;
+			for(size_t w = 0; w < words(); w++) count += std::popcount(lv[0][w] |= w < n ? ntohll(bits[w]) : 0);
+			rebuild();
+		}
+		// The bitmap without trailing empty words
+		std::vector<uint64_t> bitmap() const{
+			size_t n = count ? (last() >> 6) + 1 : 0;
+			return std::vector<uint64_t>(lv[0].begin(), lv[0].begin() + n);
+		}
+	};
+	// A bitmap that can be updated without locking. It is made of segments that are allocated on first use and never move, each twice as big as the one before
+	struct AtomicBits{
+		static constexpr uint64_t SEG0 = 64;
+		static constexpr int SEGS = 56;
+		std::atomic<std::atomic<uint64_t>*> seg[SEGS] = {};
+		~AtomicBits(){ for(auto& p : seg) delete[] p.load(memory_order::relaxed); }
+		std::atomic<uint64_t>& word(uint64_t w){
+			int s = w < SEG0 ? 0 : std::bit_width(w / SEG0);
+			uint64_t base = s ? SEG0 << (s-1) : 0;
+			std::atomic<uint64_t>* p = seg[s].load(memory_order::acquire);
+			if(!p){
+				std::atomic<uint64_t>* fresh = new std::atomic<uint64_t>[s ? base : SEG0]();
+				if(seg[s].compare_exchange_strong(p, fresh, memory_order::acq_rel)) p = fresh;
+				else delete[] fresh;
+			}
+			return p[w - base];
+		}
+		// Return whether the bit was set before
+		bool set(uint64_t i){ return word(i >> 6).fetch_or(uint64_t(1) << (i & 63), memory_order::relaxed) >> (i & 63) & 1; }
+		bool clear(uint64_t i){ return word(i >> 6).fetch_and(~(uint64_t(1) << (i & 63)), memory_order::relaxed) >> (i & 63) & 1; }
+		bool test(uint64_t i){ return word(i >> 6).load(memory_order::relaxed) >> (i & 63) & 1; }
+	};
+	// Bucket files grow in extents of at least this many blocks (unless that would exceed MAX_EXTENT)
+	static constexpr uint64_t MIN_EXTENT_BLOCKS = 16, MAX_EXTENT = 64 << 20;
+
+	using Clock = std::chrono::steady_clock;
+	static uint64_t ns_since(Clock::time_point t){ return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t).count(); }
+	// A mutex that counts how often and for how long lock() had to wait. Uncontended locking costs nothing extra
+	struct TimedMutex: std::mutex{
+		std::atomic<uint64_t> waits = 0, wait_ns = 0;
+		void lock(){
+			if(try_lock()) return;
+			Clock::time_point t = Clock::now();
+			std::mutex::lock();
+			waits.fetch_add(1, memory_order::relaxed);
+			wait_ns.fetch_add(ns_since(t), memory_order::relaxed);
+		}
+	};
+
+	// The mutex only guards `end`, `free`, `unpunched`, `lazy` and the initialization of `fd`
+	// Once `fd` is set it never changes until the db is destroyed, so positional I/O can use it without locking
+	struct Bucket: TimedMutex{
+		std::atomic<file_t> fd = X_FILE_T_INVALID;
+		// end: high-water mark of allocated blocks, persisted in the frees file. -1 if unknown, in which case the file size is used
+		// cap: preallocated size of the file, always >= end
+		uint64_t end = -1, cap = 0;
+		// Block size and bucket #, to convert between block IDs and indexes (offset / size). Set on creation
+		uint64_t size = 0;
+		int num = 0;
+		// The bucket file, in one of the data folders (see dir_of()), and which one. Set on creation
+		std::string path;
+		int dir = 0;
+		// Indexes of free blocks, lowest first. Blocks that threads took into their magazines are not in it, but are still marked in `is_free`
+		BitTree free;
+		// Marks every free block, wherever it is, so that a double free is caught with a single atomic op. Updated without the lock
+		// Only blocks below `limit` (a past end / size) are, so that a bogus ID can't make it allocate a huge segment
+		AtomicBits is_free;
+		std::atomic<uint64_t> limit = 0;
+		// Free blocks whose disk space reclaim() hasn't released yet
+		BitTree unpunched;
+		std::atomic<Map*> map = 0;
+		// Changes to `free` since the last flush, host-endian: the ID of a block that became free, or ID|USED_BIT for one that was taken out
+		// If this grows much bigger than the bitmap of `free` it is dropped, and the next flush writes a checkpoint instead
+		std::vector<uint64_t> changes;
+		bool changes_dropped = false;
+		// Opened with x_open_direct(). Set before fd is, and never changes after
+		bool direct = false;
+		// Side tables of block checksums (see Options::checksums) and compressed lengths (see Options::compress_min). Opened before fd is set, and never change after
+		// A bucket that has a side table keeps it up to date even when the db is reopened without the option, so that it never goes stale
+		bool checksummed = false, compressed = false;
+		SideTable crc, zlen;
+		// Free blocks that are still only in the mapped frees file, see load_free(): lazy_n bitmap words, or block IDs if lazy_ids
+		std::atomic<const uint64_t*> lazy = 0;
+		size_t lazy_n = 0;
+		bool lazy_ids = false;
+		// Journal changes to the free list, applied on top of the run by load_free(): block IDs that became free, or stopped being free with USED_BIT set
+		std::vector<uint64_t> lazy_changes;
+		// `end` as of the last flush. Only accessed by flush(), under master_lock
+		uint64_t flushed_end = -1;
+		// Written to since the last flush, so the file needs an fsync. Buckets that handed out a view_mut() are fsynced on every flush
+		std::atomic<bool> dirty = false, mapped_mut = false;
+		// Handed out any view, whose readers must see write()s, so they are never held back in the block cache
+		std::atomic<bool> mapped = false;
+		// compact() fences off the blocks at or above `fence` while it moves them. Writes to other blocks go ahead unlocked, counted in writers[] so that it can wait for those that started before the fence went up
+		std::atomic<uint64_t> fence = -1;
+		std::atomic<uint32_t> fence_gen = 0, writers[2] = {0, 0};
+		// Returns the slot to pass to write_done(), or -1 if compact() may be moving the block, see fenced()
+		int write_start(uint64_t block){
+			while(true){
+				uint32_t g = fence_gen.load();
+				writers[g&1].fetch_add(1);
+				// A fence_off() in between may not wait for this slot, so it is tried again
+				if(fence_gen.load() == g){
+					if(block < fence.load()) return g&1;
+					writers[g&1].fetch_sub(1, memory_order::release);
+					return -1;
+				}
+				writers[g&1].fetch_sub(1, memory_order::release);
+			}
+		}
+		void write_done(int slot){ writers[slot].fetch_sub(1, memory_order::release); }
+		// Fence off the blocks at or above `lo`. Returns the slot of the writes that may not have seen it, for fence_wait()
+		int fence_off(uint64_t lo){
+			fence.store(lo);
+			return fence_gen.fetch_add(1) & 1;
+		}
+		void fence_wait(int slot){ while(writers[slot].load(memory_order::acquire)) std::this_thread::yield(); }
+		void touch(){ if(!dirty.load(memory_order::relaxed)) dirty.store(true, memory_order::relaxed); }
+		void note(uint64_t v){
+			if(changes_dropped) return;
+			if(changes.size() > (free.words() + lazy_n)*2 + 4096){
+				changes_dropped = true;
+				std::vector<uint64_t>().swap(changes);
+			}else changes.push_back(v);
+		}
+		~Bucket(){
+			for(Map* m : {map.load(memory_order::relaxed), crc.map.load(memory_order::relaxed), zlen.map.load(memory_order::relaxed)}) while(m){
+				Map* prev = m->prev;
+				x_pagefree(m->base, m->pages);
+				delete m;
+				m = prev;
+			}
+		}
+		uint64_t index(uint64_t id) const{ return (id & ~uint64_t(0xFF)) / size; }
+		uint64_t id(uint64_t i) const{ return i * size | num; }
+		// A block that is marked in `is_free` enters or leaves `free`. Must be called with the lock held
+		void put(uint64_t i){
+			free.set(i);
+			unpunched.set(i);
+		}
+		void take(uint64_t i){
+			free.clear(i);
+			unpunched.clear(i);
+		}
+		// Must be called with the lock held, before `free` or `is_free` are used
+		void load_free(){
+			const uint64_t* run = lazy.load(memory_order::relaxed);
+			if(!run) return;
+			if(lazy_ids){
+				for(size_t k = 0; k < lazy_n; k++){
+					uint64_t i = index(ntohll(run[k]));
+					is_free.set(i);
+					put(i);
+				}
+			}else{
+				free.merge(run, lazy_n);
+				unpunched.merge(run, lazy_n);
+				for(size_t w = 0; w < lazy_n; w++) if(run[w]) is_free.word(w).fetch_or(ntohll(run[w]), memory_order::relaxed);
+			}
+			for(uint64_t v : lazy_changes){
+				uint64_t i = index(v & ~USED_BIT);
+				if(v & USED_BIT){
+					is_free.clear(i);
+					take(i);
+				}else{
+					is_free.set(i);
+					put(i);
+				}
+			}
+			std::vector<uint64_t>().swap(lazy_changes);
+			lazy_n = 0;
+			lazy.store(0, memory_order::release);
+		}
+		// For callers that don't hold the lock
+		void ensure_loaded(){
+			if(!lazy.load(memory_order::acquire)) return;
+			std::lock_guard _(*this);
+			load_free();
+		}
+		// Must be called with the lock held
+		bool check_init(){
+			if(fd.load(memory_order::relaxed) == X_FILE_T_INVALID){
+				const std::string& name = path;
+				file_t f = direct ? x_open_direct(name.c_str()) : X_FILE_T_INVALID;
+				if(f == X_FILE_T_INVALID){
+					direct = false;
+					f = x_open(name.c_str());
+				}
+				if(f == X_FILE_T_INVALID) return false;
+				if(!open_side(crc, name + ".crc", checksummed) || !open_side(zlen, name + ".z", compressed)){
+					for(file_t side : {f, crc.fd, zlen.fd}) if(side != X_FILE_T_INVALID) x_close(side);
+					crc.fd = zlen.fd = X_FILE_T_INVALID;
 					return false;
-				end = x_getsize(fd);
+				}
+				cap = x_getsize(f);
+				if(end > cap) end = cap;
+				fd.store(f, memory_order::release);
 			}
 			return true;
 		}
+		static bool open_side(SideTable& t, const std::string& name, bool want){
+			if(!want && x_stat(name.c_str()).type == X_FILE_NOT_FOUND) return true;
+			return (t.fd = x_open(name.c_str())) != X_FILE_T_INVALID;
+		}
+		// Lock-free fast path for I/O, only locks the first time the file is opened
+		file_t get_fd(){
+			file_t f = fd.load(memory_order::acquire);
+			if(f != X_FILE_T_INVALID) return f;
+			std::lock_guard _(*this);
+			return check_init() ? fd.load(memory_order::relaxed) : X_FILE_T_INVALID;
+		}
 	};
 	// 1024 -> ...
 	// 1280 -> ...
@@ -66,155 +505,2133 @@ class AllocDB{
 
 	static constexpr int TOP_ARRAY_LEN = (MAX_BUCKETS+7) / 8;
 	std::atomic<Bucket*> fds[TOP_ARRAY_LEN] = {0};
+	// Folder of the metadata files (frees, journal, batches), the first of dirs. Bucket files are spread over all of dirs
 	std::string prefix;
-	std::mutex master_lock;
+	std::vector<std::string> dirs;
+	TimedMutex master_lock;
 	std::atomic<uint64_t> a_root = 0;
+	// Guarded by master_lock
+	uint64_t gen = 0;
+	file_t journal;
+	uint64_t journal_off = 0;
+	// Set when the journal no longer holds every change since the checkpoint (a flush failed, or it is of an older format), so the next flush must write a checkpoint
+	bool must_checkpoint = false;
+
+	// Per-thread magazines of free block IDs (host-endian, bucket-tagged), refilled from and drained to Bucket::free in batches
+	// The lock is only ever contended by flush(), compaction and thread teardown, so the alloc()/free() fast path never touches a shared lock
+	static constexpr int MAGAZINE_SIZE = 64, MAGAZINE_BATCH = 32;
+	struct ThreadCache{
+		// A flag rather than a mutex: the owning thread takes it with a single exchange, and others only wait out one magazine operation
+		std::atomic<bool> busy = false;
+		void lock(){ while(busy.exchange(true, memory_order::acquire)) std::this_thread::yield(); }
+		void unlock(){ busy.store(false, memory_order::release); }
+		// 0 once the db has been destroyed. Guarded by cache_lock
+		BasicAllocDB* db;
+		std::vector<uint64_t> mags[MAX_BUCKETS];
+	};
+	// Guards ThreadCache::db and AllocDB::caches. Always locked before any ThreadCache, which is always locked before any Bucket
+	static inline std::mutex cache_lock;
+	static inline std::atomic<uint64_t> next_id = 0;
+	const uint64_t id = next_id.fetch_add(1, memory_order::relaxed);
+	std::vector<ThreadCache*> caches;
+	// Owned by the thread, returns every magazine to its db when the thread exits
+	struct ThreadCaches: std::vector<std::pair<uint64_t, ThreadCache*>>{
+		~ThreadCaches(){
+			std::lock_guard _(cache_lock);
+			for(auto [id, tc] : *this){
+				if(BasicAllocDB* db = tc->db){
+					db->drain(*tc);
+					std::erase(db->caches, tc);
+				}
+				delete tc;
+			}
+		}
+	};
+	ThreadCache& thread_cache(){
+		static thread_local ThreadCaches tcs;
+		for(auto [i, tc] : tcs) if(i == id) return *tc;
+		ThreadCache* tc = new ThreadCache();
+		tc->db = this;
+		std::lock_guard _(cache_lock);
+		// Caches of dbs destroyed since are reclaimed here, or when the thread exits
+		std::erase_if(tcs, [](auto& e){
+			if(e.second->db) return false;
+			delete e.second;
+			return true;
+		});
+		caches.push_back(tc);
+		tcs.push_back({id, tc});
+		return *tc;
+	}
+	// Must be called with cache_lock held
+	void drain(ThreadCache& tc){
+		std::lock_guard _(tc);
+		for(int bucket = 0; bucket < MAX_BUCKETS; bucket++){
+			auto& mag = tc.mags[bucket];
+			if(mag.empty()) continue;
+			Bucket& bk = get_bucket(bucket);
+			std::lock_guard _(bk);
+			for(uint64_t a : mag){
+				bk.put(bk.index(a));
+				bk.note(a);
+			}
+			mag.clear();
+		}
+	}
+	// Must be called with cache_lock held
+	void drain_all(bool detach){
+		for(ThreadCache* tc : caches){
+			drain(*tc);
+			if(!detach) continue;
+			// Left behind on its thread until reclaimed, so without its magazines' memory
+			std::lock_guard _(*tc);
+			for(auto& mag : tc->mags) std::vector<uint64_t>().swap(mag);
+			tc->db = 0;
+		}
+		if(detach) caches.clear();
+	}
+
+	// Small object tier: objects of up to SMALL_MAX bytes are packed into slabs, which are ordinary bucket 0 blocks
+	// A small object's ID is slab offset << 4 | slot << 8 | (SMALL_TAG + size class), so it fits the 8 bit tag scheme and never collides with bucket or record tags
+	// Free slots are persisted like free blocks, as their IDs, noted in bucket 0's change log so that slab and slot changes are journaled in the order they happen
+	static constexpr uint16_t SMALL_SIZES[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+	static constexpr int SMALL_MAX = Geometry::SMALL_MAX, SMALL_TAG = MAX_BUCKETS,
+		SMALL_CLASSES = std::count_if(std::begin(SMALL_SIZES), std::end(SMALL_SIZES), [](int sz){ return sz <= SMALL_MAX; });
+	static_assert(SMALL_TAG + SMALL_CLASSES <= 0xFA && (!SMALL_CLASSES || SMALLEST_BUCKET >= 1024));
+	static bool is_small(uint64_t ptr){ return (ptr & 0xFF) - SMALL_TAG < uint64_t(SMALL_CLASSES); }
+	// Slab offsets have SLAB_BITS low zero bits, which leaves room in the ID for up to SLOTS_MAX slot #s, enough for a slab full of the smallest class
+	static constexpr int SLAB_BITS = std::countr_zero(unsigned(SMALLEST_BUCKET)), SLOTS_MAX = SMALLEST_BUCKET / 16, SLAB_WORDS = (SLOTS_MAX + 63) / 64;
+	static int small_slots(int c){ return SMALLEST_BUCKET / SMALL_SIZES[c]; }
+	static uint64_t small_id(uint64_t slab, int slot, int c){ return slab << 4 | uint64_t(slot) << 8 | (SMALL_TAG + c); }
+	static uint64_t small_slab(uint64_t id){ return id >> (SLAB_BITS + 4) << SLAB_BITS; }
+	static int small_slot(uint64_t id){ return id >> 8 & (SLOTS_MAX - 1); }
+	// Bitmap of the free slots of a slab
+	using SlabBits = std::array<uint64_t, SLAB_WORDS>;
+	static SlabBits all_slots(int n){
+		SlabBits bits = {};
+		for(int i = 0; i < n; i++) bits[i >> 6] |= uint64_t(1) << (i & 63);
+		return bits;
+	}
+	static bool no_slots(const SlabBits& bits){ return std::all_of(bits.begin(), bits.end(), [](uint64_t w){ return !w; }); }
+	static int first_slot(const SlabBits& bits){
+		int w = 0;
+		while(!bits[w]) w++;
+		return w * 64 + std::countr_zero(bits[w]);
+	}
+	struct SmallClass: TimedMutex{
+		// Slabs with at least one free slot: slab offset -> bitmap of free slots
+		std::unordered_map<uint64_t, SlabBits> slabs;
+		// Allocations are served from the same slab until it is full, so objects allocated together end up together
+		uint64_t current = -1;
+		std::atomic<uint64_t> free_slots = 0;
+	};
+	// Always locked before any ThreadCache or Bucket
+	std::array<SmallClass, SMALL_CLASSES> small;
+	// Mark a slot as free or taken, without journaling it. Must be called with the class locked (or during construction). Returns false if it already was
+	bool small_mark(uint64_t id, bool is_free){
+		SmallClass& sc = small[(id & 0xFF) - SMALL_TAG];
+		uint64_t slab = small_slab(id), bit = uint64_t(1) << (small_slot(id) & 63);
+		int w = small_slot(id) >> 6;
+		if(is_free){
+			uint64_t& bits = sc.slabs[slab][w];
+			if(bits & bit) return false;
+			bits |= bit;
+		}else{
+			auto it = sc.slabs.find(slab);
+			if(it == sc.slabs.end() || !(it->second[w] & bit)) return false;
+			it->second[w] &= ~bit;
+			if(no_slots(it->second)) sc.slabs.erase(it);
+		}
+		sc.free_slots.fetch_add(is_free ? 1 : -1, memory_order::relaxed);
+		return true;
+	}
+	uint64_t alloc_small(int c){
+		SmallClass& sc = small[c];
+		Bucket& bk0 = get_bucket(0);
+		std::lock_guard _(sc);
+		auto it = sc.slabs.find(sc.current);
+		if(it == sc.slabs.end()) it = sc.slabs.begin();
+		if(it == sc.slabs.end()){
+			uint64_t size = SMALLEST_BUCKET, slab = alloc(size);
+			if(slab == uint64_t(-1)) return -1;
+			int n = small_slots(c);
+			it = sc.slabs.emplace(slab, all_slots(n)).first;
+			sc.free_slots.fetch_add(n, memory_order::relaxed);
+			std::lock_guard _(bk0);
+			for(int i = 0; i < n; i++) bk0.note(small_id(slab, i, c));
+		}
+		sc.current = it->first;
+		uint64_t id = small_id(it->first, first_slot(it->second), c);
+		small_mark(id, false);
+		{
+			std::lock_guard _(bk0);
+			bk0.note(id | USED_BIT);
+		}
+		return id;
+	}
+	void free_small(uint64_t ptr){
+		int c = (ptr & 0xFF) - SMALL_TAG;
+		SmallClass& sc = small[c];
+		Bucket& bk0 = get_bucket(0);
+		uint64_t slab = small_slab(ptr);
+		int n = small_slots(c);
+		if(small_slot(ptr) >= n || !below_end(bk0, bk0.index(slab))) return;
+		std::lock_guard _(sc);
+		// Double frees are ignored. So are frees into a slab that went back to bucket 0 when its last object was freed, which would otherwise adopt it again while bucket 0 can hand it out
+		if(bk0.is_free.test(bk0.index(slab)) || !small_mark(ptr, true)){
+			double_frees.fetch_add(1, memory_order::relaxed);
+			return;
+		}
+		// Slabs that become empty go back to bucket 0, except the one being allocated from, so that alloc/free pairs don't churn slabs
+		if(sc.slabs[slab] != all_slots(n) || slab == sc.current){
+			std::lock_guard _(bk0);
+			bk0.note(ptr);
+			return;
+		}
+		sc.slabs.erase(slab);
+		sc.free_slots.fetch_sub(n - 1, memory_order::relaxed);
+		{
+			std::lock_guard _(bk0);
+			for(int i = 0; i < n; i++) if(small_id(slab, i, c) != ptr) bk0.note(small_id(slab, i, c) | USED_BIT);
+		}
+		free(slab);
+	}
+
+	// Operation counters, sharded so that threads don't contend on the same cache lines. Threads are assigned a shard round-robin, shared by all dbs
+	static constexpr int STAT_SHARDS = 16, LATENCY_BINS = 32;
+	enum{ STAT_ALLOC, STAT_FREE, STAT_READ, STAT_WRITE, STAT_BYTES_READ, STAT_BYTES_WRITTEN, STAT_COUNT };
+	struct alignas(64) StatShard{
+		std::atomic<uint64_t> ops[MAX_BUCKETS][STAT_COUNT] = {};
+		// Bin i counts I/O operations that took [2^i, 2^(i+1)) ns
+		std::atomic<uint64_t> latency[2][LATENCY_BINS] = {};
+	};
+	std::unique_ptr<StatShard[]> stat_shards{new StatShard[STAT_SHARDS]};
+	static inline std::atomic<unsigned> next_shard = 0;
+	StatShard& stat_shard(){
+		static thread_local unsigned i = next_shard.fetch_add(1, memory_order::relaxed) % STAT_SHARDS;
+		return stat_shards[i];
+	}
+	void count(int bucket, int op, uint64_t bytes = 0){
+		StatShard& sh = stat_shard();
+		sh.ops[bucket][op].fetch_add(1, memory_order::relaxed);
+		if(bytes) sh.ops[bucket][op + STAT_BYTES_READ - STAT_READ].fetch_add(bytes, memory_order::relaxed);
+	}
+	void count_io(bool write, uint64_t ns){
+		int bin = std::min(63 - std::countl_zero(ns | 1), LATENCY_BINS-1);
+		stat_shard().latency[write][bin].fetch_add(1, memory_order::relaxed);
+	}
+	// Guarded by master_lock
+	uint64_t flushes = 0, flush_ns = 0, flush_max_ns = 0, checkpoints = 0;
+
+	// Built-in block cache: ARC (adaptive replacement cache) accounted in bytes rather than entries, sharded by block pointer
+	// T1 holds blocks seen once, T2 blocks seen more than once, B1/B2 remember keys recently evicted from them and steer the T1/T2 split
+	// A one-off scan only ever passes through T1, so it cannot flush out the frequently used blocks in T2
+	static constexpr int CACHE_SHARDS = 16;
+	enum{ T1, T2, B1, B2 };
+	struct CacheEntry{
+		uint64_t size;
+		// 0 for ghosts (B1/B2)
+		char* data;
+		bool dirty;
+		uint8_t list;
+		std::list<uint64_t>::iterator it;
+	};
+	struct CacheShard: std::mutex{
+		std::unordered_map<uint64_t, CacheEntry> map;
+		// Most recently used first
+		std::list<uint64_t> lists[4];
+		uint64_t bytes[4] = {0}, target = 0, cap = 0;
+		// Bumped by every write, so a read that missed can tell if it's too late to fill the cache with what it read
+		uint64_t writes = 0;
+		std::atomic<uint64_t> hits = 0, misses = 0;
+	};
+	CacheShard* cache = 0;
+	bool write_back = false;
+	// Dirty blocks whose write back failed. They stay dirty in the cache and are retried by the next flush or eviction, except when closing, where they are retried once and then dropped
+	std::atomic<uint64_t> writeback_errors = 0;
+	CacheShard& cache_shard(uint64_t ptr){ return cache[(ptr >> 8) * 0x9E3779B97F4A7C15 >> 60 & (CACHE_SHARDS-1)]; }
+	bool cache_writeback(uint64_t ptr, CacheEntry& e){
+		if(!e.dirty) return true;
+		Bucket& bk = get_bucket(ptr & 0xFF);
+		file_t fd = bk.get_fd();
+		if(fd == X_FILE_T_INVALID || !block_write(bk, ptr & 0xFF, fd, ptr & ~uint64_t(0xFF), 0, e.data, e.size)){
+			writeback_errors.fetch_add(1, memory_order::relaxed);
+			return false;
+		}
+		// After the write, so that a flush in between can't sync the file before it and clear the flag for it
+		bk.touch();
+		e.dirty = false;
+		return true;
+	}
+	// All cache_* functions below must be called with the shard locked
+	void cache_move(CacheShard& sh, uint64_t ptr, CacheEntry& e, uint8_t list){
+		sh.lists[e.list].erase(e.it);
+		sh.bytes[e.list] -= e.size;
+		sh.lists[list].push_front(ptr);
+		sh.bytes[list] += e.size;
+		e.it = sh.lists[list].begin();
+		e.list = list;
+	}
+	void cache_forget(CacheShard& sh, uint64_t ptr, bool writeback){
+		auto it = sh.map.find(ptr);
+		if(it == sh.map.end()) return;
+		CacheEntry& e = it->second;
+		if(e.data){
+			// Kept rather than lose the only copy of its data
+			if(writeback && !cache_writeback(ptr, e)) return;
+			::free(e.data);
+		}
+		sh.lists[e.list].erase(e.it);
+		sh.bytes[e.list] -= e.size;
+		sh.map.erase(it);
+	}
+	// Evict until `need` more bytes fit, turning evicted entries into ghosts
+	void cache_make_room(CacheShard& sh, uint64_t need, bool b2_hit){
+		while(sh.bytes[T1] + sh.bytes[T2] + need > sh.cap && (sh.bytes[T1] || sh.bytes[T2])){
+			int from = sh.bytes[T1] && (sh.bytes[T1] > sh.target || (b2_hit && sh.bytes[T1] == sh.target) || !sh.bytes[T2]) ? T1 : T2;
+			uint64_t ptr = sh.lists[from].back();
+			CacheEntry& e = sh.map[ptr];
+			// Kept rather than lose the only copy of its data, so the cache may stay over its capacity until the write back succeeds
+			if(!cache_writeback(ptr, e)) break;
+			::free(e.data);
+			e.data = 0;
+			cache_move(sh, ptr, e, from == T1 ? B1 : B2);
+		}
+		while(sh.bytes[T1] + sh.bytes[B1] > sh.cap && sh.bytes[B1]) cache_forget(sh, sh.lists[B1].back(), false);
+		while(sh.bytes[T1] + sh.bytes[T2] + sh.bytes[B1] + sh.bytes[B2] > sh.cap*2 && sh.bytes[B2]) cache_forget(sh, sh.lists[B2].back(), false);
+	}
+	void cache_insert(CacheShard& sh, uint64_t ptr, uint64_t size, const void* data, bool dirty){
+		// Too big to be worth caching
+		if(size > sh.cap >> 3) return;
+		auto it = sh.map.find(ptr);
+		uint8_t list = T1;
+		bool b2_hit = false;
+		if(it != sh.map.end()){
+			CacheEntry& e = it->second;
+			if(e.data){
+				memcpy(e.data, data, size);
+				e.dirty |= dirty;
+				cache_move(sh, ptr, e, T2);
+				return;
+			}
+			// Ghost hit: adapt the T1/T2 split towards whichever list would have kept it
+			if(e.list == B1) sh.target = std::min(sh.cap, sh.target + std::max(sh.bytes[B2] / std::max(sh.bytes[B1], uint64_t(1)), uint64_t(1)) * size);
+			else sh.target -= std::min(sh.target, std::max(sh.bytes[B1] / std::max(sh.bytes[B2], uint64_t(1)), uint64_t(1)) * size);
+			b2_hit = e.list == B2;
+			list = T2;
+			cache_forget(sh, ptr, false);
+		}
+		cache_make_room(sh, size, b2_hit);
+		char* buf = (char*) malloc(size);
+		if(!buf) return;
+		memcpy(buf, data, size);
+		sh.lists[list].push_front(ptr);
+		sh.bytes[list] += size;
+		sh.map[ptr] = {size, buf, dirty, list, sh.lists[list].begin()};
+	}
+	// Write back every dirty cached block, and drop them all if asked. Must be called without any shard locked
+	void cache_flush(bool drop){
+		if(!cache) return;
+		for(int i = 0; i < CACHE_SHARDS; i++){
+			CacheShard& sh = cache[i];
+			std::lock_guard _(sh);
+			for(auto& [ptr, e] : sh.map){
+				// Nothing will retry it after this, so give it a second chance before its data is lost
+				if(e.data && !cache_writeback(ptr, e) && drop && !cache_writeback(ptr, e)){
+					errno = errno ? errno : EIO;
+					perror(("AllocDB: dropping a dirty cached block of bucket " + std::to_string(ptr & 0xFF) + " on close").c_str());
+				}
+			}
+			if(drop) while(sh.map.size()) cache_forget(sh, sh.map.begin()->first, false);
+		}
+	}
+	// Drop a block from the cache, for when it's about to be accessed some other way
+	void cache_drop(uint64_t ptr, bool writeback){
+		if(!cache) return;
+		CacheShard& sh = cache_shard(ptr);
+		std::lock_guard _(sh);
+		sh.writes++;
+		cache_forget(sh, ptr, writeback);
+	}
 public:
 	uint64_t root(){ return a_root.load(memory_order::relaxed); }
 	void root(uint64_t r){ a_root.store(r, memory_order::relaxed); }
 
-	// frees file: network-endian u64 array: [root] [free_blocks...]
+	// Stages writes, allocs, frees and a root change to be applied all at once by commit()
+	// Allocs are real allocations, journaled by any flush before the commit. A crash before it leaks them, as nothing points to them yet
+	class WriteBatch{
+		struct Write{
+			uint64_t ptr, off, len;
+			// Offset of the data in `data`
+			size_t at;
+		};
+		BasicAllocDB& db;
+		std::vector<uint64_t> allocs, frees;
+		std::vector<Write> writes;
+		std::vector<char> data;
+		bool has_root = false;
+		uint64_t new_root = -1;
+		friend class BasicAllocDB;
+		public:
+		WriteBatch(BasicAllocDB& db) : db(db){}
+		WriteBatch(const WriteBatch&) = delete;
+		~WriteBatch(){ for(uint64_t a : allocs) db.free(a); }
+		uint64_t alloc(uint64_t& size){
+			uint64_t a = db.alloc(size);
+			if(a != uint64_t(-1)) allocs.push_back(a);
+			return a;
+		}
+		void free(uint64_t ptr){ frees.push_back(ptr); }
+		bool write(uint64_t ptr, const void* buf){ return write_at(ptr, 0, size_of(ptr), buf); }
+		bool write_at(uint64_t ptr, uint64_t off, uint64_t len, const void* buf){
+			uint64_t size = size_of(ptr);
+			if(!size || off > size || len > size-off) return false;
+			writes.push_back({ptr, off, len, data.size()});
+			data.insert(data.end(), (const char*) buf, (const char*) buf + len);
+			return true;
+		}
+		void root(uint64_t r){
+			has_root = true;
+			new_root = r;
+		}
+		bool commit(){
+			if(!db.commit(*this)) return false;
+			allocs.clear(); frees.clear(); writes.clear(); data.clear();
+			has_root = false;
+			return true;
+		}
+	};
+	private:
+	// The record is synced before anything is applied, and flushes wait for applies in progress, so recovery either redoes all of it or finds it covered by the journal
+	// Only the record is appended under master_lock. Batches committed concurrently are applied concurrently, so if they write the same bytes, which one wins is unspecified
+	bool commit(WriteBatch& b){
+		uint64_t off;
+		// get_bucket() may need master_lock, so bucket arrays are created beforehand
+		for(auto& w : b.writes) get_bucket(slab_of(w.ptr, off) & 0xFF);
+		for(uint64_t f : b.frees) if(size_of(f)) get_bucket(slab_of(f, off) & 0xFF);
+		std::vector<uint64_t> rec(8);
+		for(uint64_t a : b.allocs) rec.push_back(htonll(a));
+		for(uint64_t f : b.frees) rec.push_back(htonll(f));
+		for(auto& w : b.writes){
+			rec.push_back(htonll(w.ptr));
+			rec.push_back(htonll(w.off));
+			rec.push_back(htonll(w.len));
+			size_t at = rec.size();
+			rec.resize(at + ((w.len+7) >> 3));
+			memcpy(rec.data() + at, b.data.data() + w.at, w.len);
+		}
+		rec.push_back(0);
+		rec[0] = htonll(rec.size() << 8 | BATCH_TAG);
+		rec[3] = htonll(uint64_t(b.has_root));
+		rec[4] = htonll(b.new_root);
+		rec[5] = htonll(b.allocs.size());
+		rec[6] = htonll(b.frees.size());
+		rec[7] = htonll(b.writes.size());
+		{
+			std::lock_guard _(master_lock);
+			rec[1] = htonll(gen);
+			rec[2] = htonll(journal_off);
+			rec.back() = batch_checksum(rec.data(), rec.size()-1);
+			if(x_write(batches, rec.data(), batches_off, rec.size()*8) < rec.size()*8 || !x_datasync(batches)){
+				x_setsize(batches, batches_off);
+				return false;
+			}
+			batches_off += rec.size()*8;
+			std::lock_guard _a(apply_lock);
+			applying++;
+		}
+		for(auto& w : b.writes) write_through(w.ptr, w.off, w.len, b.data.data() + w.at);
+		for(uint64_t f : b.frees) free_now(f);
+		if(b.has_root) a_root.store(b.new_root, memory_order::relaxed);
+		std::lock_guard _(apply_lock);
+		if(!--applying) applied.notify_all();
+		return true;
+	}
+	public:
+
+	// frees file (checkpoint): network-endian u64 array: [root] [free_blocks...] (free blocks keep their bucket # in the low 8 bits)
+	// Entries with 0xFF in the low 8 bits instead record the end of a bucket: [end/block_size:48] [bucket:8] [0xFF:8]
+	// Entries with 0xFE in the low 8 bits record the checkpoint generation and the format version: [format:8] [gen:48] [0xFE:8]
+	//     Files of a format newer than FORMAT are refused. Format 1 added bitmap runs (0xFA), which versions before it can't read, and which they don't know to refuse either. Format 2 added the length and checksum of journal batches
+	// Entries with 0xFA in the low 8 bits index a bucket's free blocks: [offset:48] [bucket:8] [0xFA:8], where offset is in u64s from the start of the file
+	//     Its run lasts until the next index entry's offset, or the end of the file, and is a bitmap of the bucket's free blocks by index (offset / block size), 64 per u64, lowest in the least significant bit
+	//     Runs come after all other entries, so they are only read when the bucket is first used. Index entries with 0xFB instead of 0xFA have a run of block IDs
+	// journal file: network-endian u64 array: [format:8] [gen:48] [0xFE:8], then batches of changes since the checkpoint, each terminated by [#changes:56] [0xFD:8] [root] [checksum of the batch]
+	//     A change is the ID of a block that became free, the ID of one that stopped being free with USED_BIT set, or an end entry
+	//     The journal only applies if its generation matches the checkpoint's. Replay stops at the first batch that is incomplete or fails its checksum, such as a torn or zero-filled tail
+	//     Before format 2, batches were terminated by [0xFD] [root] only. Such journals are still replayed, and replaced by the next flush's checkpoint
+	// batches file: WriteBatch redo log, records of network-endian u64s: [words:56] [0xFC:8] [gen] [journal_off] [has_root] [root] [#allocs] [#frees] [#writes]
+	//     [allocs...] [frees...] then for every write [ptr] [off] [len] [data padded to 8 bytes], then a checksum of the record
+	//     A record only applies if gen and journal_off still match the journal's, i.e no flush completed after it was committed. It is emptied by every flush
+	static constexpr uint64_t END_TAG = 0xFF, GEN_TAG = 0xFE, COMMIT_TAG = 0xFD, BATCH_TAG = 0xFC, INDEX_TAG = 0xFB, BITMAP_TAG = 0xFA, USED_BIT = uint64_t(1) << 63, FORMAT = 2;
 
-	AllocDB(std::string folder) : prefix(std::move(folder)){
-		auto info = x_stat(prefix.c_str());
-		if(info.type == X_FILE_NOT_FOUND){
-			x_mkdir(prefix.c_str());
+	struct Options{
+		// Memory budget in bytes of the built-in block cache. 0 disables it
+		uint64_t cache_size = 0;
+		// Have write()s of cached blocks only update the cache. Blocks are then written to disk when evicted, or by flush(). Those that still can't be written when closing are lost
+		bool write_back = false;
+		// Bypass the OS page cache for buckets whose block size is a multiple of 4096
+		bool direct_io = false;
+		// Keep a CRC32C of every block, updated by writes and verified by reads. A mismatch fails the read with errno set to EBADMSG
+		bool checksums = false;
+		// Compress blocks of buckets whose block size is at least this many bytes. 0 disables it
+		uint64_t compress_min = 0;
+		// Threads that load the free lists in the background after opening. With 0, each bucket's is loaded by the first operation that needs it
+		int load_threads = 0;
+	};
+	BasicAllocDB(std::string folder) : BasicAllocDB(std::move(folder), Options()){}
+	BasicAllocDB(std::string folder, const Options& opts) : BasicAllocDB(std::vector<std::string>{std::move(folder)}, opts){}
+	// Bucket files are spread over several folders, ideally on different devices, one bucket per folder in turn. Metadata lives in the first one
+	// Pointers don't depend on the folders: an existing bucket file is found in any of them, so folders can be added or reordered between runs
+	BasicAllocDB(std::vector<std::string> folders) : BasicAllocDB(std::move(folders), Options()){}
+	BasicAllocDB(std::vector<std::string> folders, const Options& opts) : prefix(folders.at(0)), dirs(std::move(folders)){
+		direct_io = opts.direct_io;
+		checksums = opts.checksums;
+		compress_min = opts.compress_min;
+		async_ring.fd = -1;
+		async_wake.fd = X_FILE_T_INVALID;
+		if(opts.cache_size){
+			cache = new CacheShard[CACHE_SHARDS];
+			for(int i = 0; i < CACHE_SHARDS; i++) cache[i].cap = opts.cache_size / CACHE_SHARDS;
+			write_back = opts.write_back;
+		}
+		for(const std::string& d : dirs){
+			auto info = x_stat(d.c_str());
+			if(info.type == X_FILE_NOT_FOUND){
+				x_mkdir(d.c_str());
+			}
 		}
 		file_t f = x_open((prefix+"/frees").c_str());
 		size_t f_sz = x_getsize(f);
-		uint64_t* frees = (uint64_t*) malloc(f_sz);
-		size_t filled = x_read(f, frees, 0, f_sz);
-		if(filled < f_sz) memset(frees+filled, 0, f_sz-filled);
+		// Mapped rather than read, so that free lists are only paged in once their bucket is used
+		frees_pages = (f_sz + X_PAGE_SIZE-1) >> 16;
+		uint64_t* frees = f_sz ? (uint64_t*) x_mapfile(f, 0, frees_pages, true) : 0;
+		bool mapped = frees;
+		if(!mapped){
+			frees_pages = 0;
+			frees = (uint64_t*) malloc(f_sz);
+			size_t filled = x_read(f, frees, 0, f_sz);
+			if(filled < f_sz) memset((char*) frees+filled, 0, f_sz-filled);
+		}
 
 		a_root.store(f_sz ? ntohll(frees[0]) : -1, memory_order::relaxed);
 
-		int last = -1;
 		f_sz >>= 3;
-		std::vector<uint64_t>* vec;
-		for(size_t i = 1; i < f_sz; i++){
+		// Index entries (bucket, offset, tag), and where the first run starts
+		std::vector<std::tuple<int, size_t, int>> runs;
+		size_t runs_off = f_sz;
+		for(size_t i = 1; i < runs_off; i++){
 			uint64_t v = frees[i];
 			int bucket = ntohll(v)&0xFF;
-			if(bucket >= MAX_BUCKETS) continue;
-			if(last != bucket){
-				last = bucket;
-				Bucket* b_arr = fds[bucket>>3].load(memory_order::relaxed);
-				if(!b_arr)
-					fds[bucket>>3].store(b_arr = new Bucket[TOP_ARRAY_LEN](), memory_order::release);
-				vec = &b_arr[bucket&7].free;
+			if(bucket == END_TAG){
+				bucket = ntohll(v)>>8&0xFF;
+				if(bucket < MAX_BUCKETS){
+					Bucket& bk = get_bucket(bucket);
+					bk.end = bk.flushed_end = (ntohll(v)>>16) * bucket_size(bucket);
+				}
+				continue;
 			}
-			vec->push_back(v);
+			if(bucket == GEN_TAG){
+				if(ntohll(v) >> 56 > FORMAT){
+					errno = EPROTO;
+					perror(("AllocDB: " + prefix + "/frees is of a newer format").c_str());
+					abort();
+				}
+				gen = ntohll(v)>>8 & ((uint64_t(1) << 48) - 1);
+				continue;
+			}
+			if(bucket == INDEX_TAG || bucket == BITMAP_TAG){
+				size_t off = std::min<size_t>(ntohll(v)>>16, f_sz);
+				if(off <= i || (runs.size() && off < std::get<1>(runs.back()))) continue;
+				runs.push_back({ntohll(v)>>8&0xFF, off, bucket});
+				runs_off = std::min(runs_off, off);
+				continue;
+			}
+			if(is_small(ntohll(v))){
+				small_mark(ntohll(v), true);
+				continue;
+			}
+			if(bucket >= MAX_BUCKETS) continue;
+			Bucket& bk = get_bucket(bucket);
+			uint64_t b = bk.index(ntohll(v));
+			bk.is_free.set(b);
+			bk.put(b);
 		}
+		for(size_t k = 0; k < runs.size(); k++){
+			auto [bucket, off, tag] = runs[k];
+			if(bucket >= MAX_BUCKETS) continue;
+			Bucket& bk = get_bucket(bucket);
+			bk.load_free();
+			bk.lazy_n = (k+1 < runs.size() ? std::get<1>(runs[k+1]) : f_sz) - off;
+			bk.lazy_ids = tag == INDEX_TAG;
+			bk.lazy.store(frees + off, memory_order::relaxed);
+			// Runs are only left in the file if it stays mapped, and each bucket has one
+			if(!mapped || bk.free.count) bk.load_free();
+		}
+		if(mapped) frees_map = frees;
+		else ::free(frees);
 		x_close(f);
+
+		journal = x_open((prefix+"/journal").c_str());
+		size_t j_sz = x_getsize(journal);
+		uint64_t* js = (uint64_t*) malloc(j_sz);
+		j_sz = x_read(journal, js, 0, j_sz) >> 3;
+		uint64_t j_head = j_sz ? ntohll(js[0]) : 0;
+		if(j_sz && (j_head & ((uint64_t(1) << 56) - 1)) == (gen<<8|GEN_TAG)){
+			journal_off = 8;
+			bool checked = j_head >> 56 >= 2;
+			// New batches must not be appended to a journal of the old format
+			must_checkpoint = !checked;
+			// block ID -> whether it ends up free
+			std::unordered_map<uint64_t, bool> state;
+			for(size_t i = 1, start = 1; i+1 < j_sz; i++){
+				uint64_t c = ntohll(js[i]);
+				if(checked ? (c & 0xFF) != COMMIT_TAG : c != COMMIT_TAG) continue;
+				if(checked && (c >> 8 != i - start || i+2 >= j_sz || batch_checksum(js + start, i+2 - start) != js[i+2])) break;
+				for(; start < i; start++){
+					uint64_t v = ntohll(js[start]);
+					if((v&0xFF) == END_TAG){
+						int bucket = v>>8&0xFF;
+						if(bucket >= MAX_BUCKETS) continue;
+						Bucket& bk = get_bucket(bucket);
+						bk.end = bk.flushed_end = (v>>16) * bucket_size(bucket);
+					}else state[v & ~USED_BIT] = !(v & USED_BIT);
+				}
+				a_root.store(ntohll(js[++i]), memory_order::relaxed);
+				i += checked;
+				start = i+1;
+				journal_off = start<<3;
+			}
+			apply_state(state, false);
+		}
+		::free(js);
+		if(journal_off) x_setsize(journal, journal_off);
+		else reset_journal();
+		replay_batches();
+		for(int i = 0; i < opts.load_threads; i++) loaders.emplace_back([this]{
+			for(int bucket; (bucket = next_load.fetch_add(1, memory_order::relaxed)) < MAX_BUCKETS;){
+				Bucket* b_arr = fds[bucket>>3].load(memory_order::acquire);
+				if(!b_arr) continue;
+				std::lock_guard _(b_arr[bucket&7]);
+				b_arr[bucket&7].load_free();
+			}
+		});
 	}
-	private: void flush(bool close){
-		std::string tmp = prefix+"/frees.tmp";
-		std::lock_guard _(master_lock);
-		file_t f = x_open(tmp.c_str());
-		uint64_t root = htonll(a_root.load(memory_order::relaxed));
-		x_write(f, &root, 0, 8);
-		size_t f_off = 8;
-		// close -> destroy everything, don't bother locking
-		// !close -> lock everything first to ensure a single consistent state to save
-		//     it's ok to unlock Bucket&s as soon as we are done with them since we don't read them after that
-		if(!close) for(int i = 0; i < TOP_ARRAY_LEN; i++){
+	private:
+	// The mapped frees file that lazy free lists point into. Guarded by master_lock
+	uint64_t* frees_map = 0;
+	size_t frees_pages = 0;
+	std::vector<std::thread> loaders;
+	std::atomic<int> next_load = 0;
+	void unmap_frees(){
+		if(frees_map) x_pagefree(frees_map, frees_pages);
+		frees_map = 0;
+	}
+	// Apply the final free/used state of block IDs replayed from the journal or batch log. With `grow`, used blocks past a bucket's end extend it
+	// Applying the same state twice changes nothing
+	void apply_state(std::unordered_map<uint64_t, bool>& state, bool grow){
+		for(auto [v, is_free] : state){
+			if(is_small(v)) small_mark(v, is_free);
+			else if((v&0xFF) < MAX_BUCKETS){
+				Bucket& bk = get_bucket(v&0xFF);
+				uint64_t end = (v & ~uint64_t(0xFF)) + bucket_size(v&0xFF), i = bk.index(v);
+				if(grow && !is_free && bk.end != uint64_t(-1) && bk.end < end) bk.end = end;
+				// Buckets whose free list is still in the frees file keep the change for when it's loaded, so that opening stays lazy
+				if(bk.lazy.load(memory_order::relaxed)){
+					bk.lazy_changes.push_back(is_free ? v : v | USED_BIT);
+					continue;
+				}
+				if(is_free){
+					bk.is_free.set(i);
+					bk.put(i);
+				}else{
+					bk.is_free.clear(i);
+					bk.take(i);
+				}
+			}
+		}
+	}
+	static uint64_t batch_checksum(const uint64_t* words, size_t n){
+		// FNV-1a over 64 bit words
+		uint64_t h = 0xCBF29CE484222325;
+		for(size_t i = 0; i < n; i++) h = (h ^ words[i]) * 0x100000001B3;
+		return h;
+	}
+	// Redo committed batches that the journal doesn't cover yet. Their writes may be torn or missing, and their allocs/frees may never have been flushed
+	void replay_batches(){
+		batches = x_open((prefix+"/batches").c_str());
+		size_t b_sz = x_getsize(batches);
+		uint64_t* bs = (uint64_t*) malloc(b_sz + 8);
+		b_sz = x_read(batches, bs, 0, b_sz) >> 3;
+		size_t i = 0;
+		bool applied = false;
+		std::unordered_map<uint64_t, bool> state;
+		while(i < b_sz){
+			uint64_t head = ntohll(bs[i]), n = head >> 8;
+			if((head & 0xFF) != BATCH_TAG || n < 9 || n > b_sz - i || batch_checksum(bs+i, n-1) != bs[i+n-1]) break;
+			uint64_t* r = bs + i;
+			i += n;
+			if(ntohll(r[1]) != gen || ntohll(r[2]) != journal_off) continue;
+			applied = true;
+			if(ntohll(r[3])) a_root.store(ntohll(r[4]), memory_order::relaxed);
+			uint64_t allocs = ntohll(r[5]), frees = ntohll(r[6]), writes = ntohll(r[7]);
+			r += 8;
+			for(uint64_t k = 0; k < allocs; k++, r++){
+				uint64_t v = ntohll(*r), off;
+				state[v] = false;
+				// The slab is just as much in use
+				if(is_small(v)) state[slab_of(v, off)] = false;
+			}
+			for(uint64_t k = 0; k < frees; k++, r++) state[ntohll(*r)] = true;
+			for(uint64_t k = 0; k < writes; k++){
+				uint64_t ptr = ntohll(r[0]), off = ntohll(r[1]), len = ntohll(r[2]);
+				write_through(ptr, off, len, r+3);
+				r += 3 + ((len+7) >> 3);
+			}
+		}
+		apply_state(state, true);
+		// None of it is in the change logs, so the next flush must write a full checkpoint before the log is emptied
+		if(applied) get_bucket(0).changes_dropped = true;
+		::free(bs);
+		// Drop the torn tail, if any, so that new records are not appended behind it
+		batches_off = i << 3;
+		x_setsize(batches, batches_off);
+	}
+	// Held around a write to a block. It goes ahead unlocked, unless compact() may be moving the block: the bucket is then locked, which waits for compact() to be done, and `ok` is false if the block was moved away (it is then past the end)
+	struct WriteGuard{
+		Bucket& bk;
+		int slot;
+		bool ok = true;
+		WriteGuard(Bucket& bk, uint64_t block) : bk(bk), slot(bk.write_start(block)){
+			if(slot >= 0) return;
+			bk.lock();
+			ok = block < bk.end;
+		}
+		~WriteGuard(){
+			if(slot >= 0) bk.write_done(slot);
+			else bk.unlock();
+		}
+	};
+	// Like write_at(), but never leaves data only in the block cache
+	bool write_through(uint64_t ptr, uint64_t off, uint64_t len, const void* buf){
+		uint64_t in_slab, block = slab_of(ptr, in_slab);
+		int bucket = block & 0xFF;
+		if(bucket >= MAX_BUCKETS) return false;
+		count(bucket, STAT_WRITE, len);
+		Bucket& bk = get_bucket(bucket);
+		WriteGuard guard(bk, block & ~uint64_t(0xFF));
+		if(!guard.ok) return false;
+		cache_drop(block, true);
+		file_t fd = bk.get_fd();
+		if(fd == X_FILE_T_INVALID) return false;
+		bool ok = block_write(bk, bucket, fd, block & ~uint64_t(0xFF), in_slab + off, buf, len);
+		bk.touch();
+		return ok;
+	}
+	// Like free(), but bypasses the thread's magazine, so that the free is noted before the call returns
+	void free_now(uint64_t ptr){
+		if(is_small(ptr)) return free_small(ptr);
+		int bucket = ptr & 0xFF;
+		if(bucket >= MAX_BUCKETS) return;
+		Bucket& bk = get_bucket(bucket);
+		if(!mark_free(bk, ptr)) return;
+		count(bucket, STAT_FREE);
+		cache_drop(ptr, false);
+		std::lock_guard _(bk);
+		bk.put(bk.index(ptr));
+		bk.note(ptr);
+	}
+	// Guarded by master_lock
+	file_t batches;
+	uint64_t batches_off = 0;
+	// Commits whose record is appended but not yet applied. flush() waits for them under master_lock, which keeps new ones from starting, as it must not empty the batches file before they are applied
+	std::mutex apply_lock;
+	std::condition_variable applied;
+	size_t applying = 0;
+	// Truncate first so that a crash in between can't leave old changes behind a new header
+	void reset_journal(){
+		x_setsize(journal, 0);
+		uint64_t header = htonll(FORMAT<<56|gen<<8|GEN_TAG);
+		x_write(journal, &header, 0, 8);
+		journal_off = 8;
+	}
+	// Buckets are only locked for as long as it takes to take a snapshot of them, so foreground operations keep running while the snapshot is written out
+	// Each bucket's snapshot is consistent on its own. No consistency is needed across buckets, as their free lists are independent
+	// free: bitmap words of free blocks, see BitTree::bitmap()
+	struct Snapshot{
+		std::vector<uint64_t> free, changes;
+		uint64_t end = -1;
+	};
+	void sync_dir(int d, bool close){
+		for(int i = 0; i < TOP_ARRAY_LEN; i++){
 			Bucket* b_arr = fds[i];
 			if(!b_arr) continue;
-			for(int j = 0; j < 8; j++)
-				b_arr[j].lock();
+			for(int j = 0; j < 8; j++){
+				Bucket& bk = b_arr[j];
+				file_t fd = bk.fd.load(memory_order::acquire);
+				if(fd == X_FILE_T_INVALID || bk.dir != d) continue;
+				if(close){
+					x_close(fd);
+					for(file_t side : {bk.crc.fd, bk.zlen.fd}) if(side != X_FILE_T_INVALID) x_close(side);
+				}else if(bk.dirty.exchange(false, memory_order::relaxed) || bk.mapped_mut.load(memory_order::relaxed)){
+					x_datasync(fd);
+					for(file_t side : {bk.crc.fd, bk.zlen.fd}) if(side != X_FILE_T_INVALID) x_datasync(side);
+				}
+			}
+		}
+	}
+	// Workers for the folders after the first, started on the first flush. A round is only started under master_lock, so they never overlap
+	std::vector<std::thread> dir_syncs;
+	std::mutex dir_sync_lock;
+	std::condition_variable dir_sync_wake, dir_sync_done;
+	uint64_t dir_sync_round = 0;
+	size_t dir_sync_pending = 0;
+	bool dir_sync_close = false, dir_sync_stop = false;
+	void dir_sync_loop(int d){
+		uint64_t seen = 0;
+		std::unique_lock lk(dir_sync_lock);
+		while(true){
+			dir_sync_wake.wait(lk, [&]{ return dir_sync_stop || dir_sync_round != seen; });
+			if(dir_sync_round == seen) break;
+			seen = dir_sync_round;
+			bool close = dir_sync_close;
+			lk.unlock();
+			sync_dir(d, close);
+			lk.lock();
+			if(!--dir_sync_pending) dir_sync_done.notify_one();
+		}
+	}
+	void flush(bool close){
+		Clock::time_point start = Clock::now();
+		{
+			std::lock_guard _(cache_lock);
+			drain_all(close);
 		}
+		cache_flush(close);
+		std::lock_guard _(master_lock);
+		{
+			std::unique_lock lk(apply_lock);
+			applied.wait(lk, [&]{ return !applying; });
+		}
+		std::unique_ptr<Snapshot[]> snaps(new Snapshot[TOP_ARRAY_LEN*8]);
+		// Append to the journal, unless that would make it bigger than a full checkpoint
+		size_t checkpoint_sz = 2, changes_sz = 3;
+		bool checkpoint = false;
 		for(int i = 0; i < TOP_ARRAY_LEN; i++){
 			Bucket* b_arr = fds[i];
 			if(!b_arr) continue;
 			for(int j = 0; j < 8; j++){
 				Bucket& bk = b_arr[j];
-				if(bk.fd == X_FILE_T_INVALID){
-					if(!close) bk.unlock();
-					continue;
+				Snapshot& snap = snaps[i<<3|j];
+				std::lock_guard _(bk);
+				snap.changes.swap(bk.changes);
+				snap.end = bk.end;
+				checkpoint_sz += bk.free.words() + bk.lazy_n + 2;
+				changes_sz += snap.changes.size() + 1;
+				checkpoint |= bk.changes_dropped;
+				bk.changes_dropped = false;
+			}
+		}
+		for(SmallClass& sc : small) checkpoint_sz += sc.free_slots.load(memory_order::relaxed);
+		checkpoint |= must_checkpoint || journal_off + changes_sz*8 > checkpoint_sz*8;
+		// The changes taken above are superseded by a full copy
+		std::vector<uint64_t> small_free;
+		if(checkpoint){
+			// Small object slots are noted in bucket 0's log, so they are copied along with bucket 0
+			for(SmallClass& sc : small) sc.lock();
+			for(int i = 0; i < TOP_ARRAY_LEN; i++){
+				Bucket* b_arr = fds[i];
+				if(!b_arr) continue;
+				for(int j = 0; j < 8; j++){
+					Bucket& bk = b_arr[j];
+					Snapshot& snap = snaps[i<<3|j];
+					std::lock_guard _(bk);
+					// The frees file is about to be replaced
+					bk.load_free();
+					snap.free = bk.free.bitmap();
+					snap.end = bk.end;
+					bk.changes.clear();
+					bk.changes_dropped = false;
 				}
-				size_t sz = bk.free.size()*8;
-				x_write(f, bk.free.data(), f_off, sz);
-				f_off += sz;
-				if(close) x_close(bk.fd);
-				else{
-					x_flush(bk.fd);
-					bk.unlock();
+			}
+			for(int c = 0; c < SMALL_CLASSES; c++){
+				for(auto& [slab, bits] : small[c].slabs)
+					for(int w = 0; w < SLAB_WORDS; w++)
+						for(uint64_t b = bits[w]; b; b &= b-1) small_free.push_back(htonll(small_id(slab, w * 64 + std::countr_zero(b), c)));
+				small[c].unlock();
+			}
+			unmap_frees();
+		}
+
+		// Block data must be on disk before the free list state that refers to it
+		// With several folders, each one's files are synced by its own worker, so that the devices flush in parallel
+		if(dirs.size() > 1){
+			std::unique_lock lk(dir_sync_lock);
+			if(dir_syncs.empty()) for(int d = 1; d < (int) dirs.size(); d++) dir_syncs.emplace_back(&BasicAllocDB::dir_sync_loop, this, d);
+			dir_sync_close = close;
+			dir_sync_round++;
+			dir_sync_pending = dirs.size() - 1;
+			dir_sync_wake.notify_all();
+			lk.unlock();
+			sync_dir(0, close);
+			lk.lock();
+			dir_sync_done.wait(lk, [&]{ return !dir_sync_pending; });
+		}else sync_dir(0, close);
+
+		bool ok;
+		if(checkpoint){
+			std::string tmp = prefix+"/frees.tmp";
+			file_t f = x_open(tmp.c_str());
+			// Everything but the runs of free blocks goes in the header, which is read in full on open
+			std::vector<uint64_t> header = {htonll(a_root.load(memory_order::relaxed)), htonll(FORMAT<<56|++gen<<8|GEN_TAG)};
+			size_t n_runs = 0;
+			for(int bucket = 0; bucket < TOP_ARRAY_LEN*8; bucket++) n_runs += !snaps[bucket].free.empty();
+			size_t off = header.size() + n_runs + small_free.size();
+			for(int bucket = 0; bucket < TOP_ARRAY_LEN*8; bucket++){
+				// Buckets never opened this session may still have a free list and end loaded from the frees file
+				Snapshot& snap = snaps[bucket];
+				if(snap.end != uint64_t(-1)){
+					header.push_back(htonll(snap.end / bucket_size(bucket) << 16 | bucket << 8 | END_TAG));
+					off++;
 				}
 			}
+			for(int bucket = 0; bucket < TOP_ARRAY_LEN*8; bucket++){
+				if(snaps[bucket].free.empty()) continue;
+				header.push_back(htonll(off << 16 | bucket << 8 | BITMAP_TAG));
+				off += snaps[bucket].free.size();
+			}
+			header.insert(header.end(), small_free.begin(), small_free.end());
+			ok = x_write(f, header.data(), 0, header.size()*8) >= header.size()*8;
+			size_t f_off = header.size()*8;
+			for(int bucket = 0; bucket < TOP_ARRAY_LEN*8; bucket++){
+				Snapshot& snap = snaps[bucket];
+				for(uint64_t& w : snap.free) w = htonll(w);
+				size_t sz = snap.free.size()*8;
+				ok = ok && x_write(f, snap.free.data(), f_off, sz) >= sz;
+				f_off += sz;
+			}
+			ok = x_flush(f) && ok;
+			x_close(f);
+			// Otherwise the last checkpoint and its journal stay in place, and so does the generation that batch records are checked against
+			if(ok && x_move(tmp.c_str(), (prefix+"/frees").c_str())){
+				// The new frees file must be the one found after a crash before the journal of its generation starts, or the journal would be ignored along with every change since the last checkpoint
+				x_syncdir(prefix.c_str());
+				reset_journal();
+				ok = x_datasync(journal);
+			}else{
+				ok = false;
+				gen--;
+			}
+		}else{
+			std::vector<uint64_t> batch;
+			batch.reserve(changes_sz);
+			for(int bucket = 0; bucket < TOP_ARRAY_LEN*8; bucket++){
+				Snapshot& snap = snaps[bucket];
+				for(uint64_t v : snap.changes) batch.push_back(htonll(v));
+				Bucket* b_arr = fds[bucket>>3];
+				if(b_arr && snap.end != b_arr[bucket&7].flushed_end)
+					batch.push_back(htonll(snap.end / bucket_size(bucket) << 16 | bucket << 8 | END_TAG));
+			}
+			batch.push_back(htonll(batch.size() << 8 | COMMIT_TAG));
+			batch.push_back(htonll(a_root.load(memory_order::relaxed)));
+			batch.push_back(batch_checksum(batch.data(), batch.size()));
+			// Only appended once it is all on disk, so that a failed batch can't leave a hole that later ones are appended behind
+			ok = x_write(journal, batch.data(), journal_off, batch.size()*8) >= batch.size()*8 && x_datasync(journal);
+			if(ok) journal_off += batch.size()*8;
+			else x_setsize(journal, journal_off);
+		}
+		// The changes of a failed flush were taken out of the change logs, so only a checkpoint can make them durable
+		must_checkpoint = !ok;
+		// Everything the batch log could redo is now covered by the journal, unless the flush failed
+		if(ok && batches_off){
+			x_setsize(batches, 0);
+			batches_off = 0;
+		}
+		uint64_t ns = ns_since(start);
+		flushes++;
+		checkpoints += checkpoint;
+		flush_ns += ns;
+		flush_max_ns = std::max(flush_max_ns, ns);
+		for(int i = 0; i < TOP_ARRAY_LEN; i++){
+			Bucket* b_arr = fds[i];
+			if(!b_arr) continue;
+			for(int j = 0; j < 8; j++) b_arr[j].flushed_end = snaps[i<<3|j].end;
 			if(close) delete[] b_arr;
 		}
-		x_close(f);
-		x_move(tmp.c_str(), (prefix+"/frees").c_str());
+		if(close){
+			x_close(journal);
+			x_close(batches);
+		}
 		// master_lock unlock()ed
 	}
+	// Bucket arrays are created lazily, 8 at a time, and never freed until the db is destroyed
+	Bucket& get_bucket(int bucket){
+		auto& atm = fds[bucket>>3];
+		Bucket* b_arr = atm.load(memory_order::acquire);
+		if(!b_arr){
+			std::lock_guard _(master_lock);
+			if(!(b_arr = atm.load(memory_order::acquire))){
+				b_arr = new Bucket[8]();
+				// Direct I/O is only possible for buckets whose blocks are all aligned
+				for(int j = 0; j < 8; j++){
+					b_arr[j].direct = direct_io && !(bucket_size((bucket & ~7) | j) & (DIRECT_ALIGN-1));
+					b_arr[j].compressed = compress_min && bucket_size((bucket & ~7) | j) >= compress_min;
+					// A compressed block and its length are written separately, so after a crash they may not match, which only the checksum can tell
+					b_arr[j].checksummed = checksums || b_arr[j].compressed;
+					b_arr[j].size = bucket_size((bucket & ~7) | j);
+					b_arr[j].num = (bucket & ~7) | j;
+					b_arr[j].dir = dir_of(b_arr[j].num);
+					b_arr[j].path = dirs[b_arr[j].dir] + "/" + std::to_string(b_arr[j].num);
+				}
+				atm.store(b_arr, memory_order::release);
+			}
+		}
+		return b_arr[bucket&7];
+	}
+	// The folder of a bucket's file: wherever it already exists, else the next one round robin
+	int dir_of(int bucket){
+		std::string name = "/" + std::to_string(bucket);
+		for(size_t d = 0; d < dirs.size(); d++) if(x_stat((dirs[d] + name).c_str()).type != X_FILE_NOT_FOUND) return d;
+		return bucket % dirs.size();
+	}
+	static constexpr uint64_t DIRECT_ALIGN = X_DIRECT_ALIGN;
+	bool direct_io = false;
+	// Aligned bounce buffers for direct I/O, kept per thread. Buffers bigger than BOUNCE_KEEP are freed after every use
+	static constexpr size_t BOUNCE_KEEP = 16 << 20;
+	struct Bounce{
+		char* buf = 0;
+		size_t pages = 0;
+		~Bounce(){ if(buf) x_pagefree(buf, pages); }
+	};
+	// Slot 0 is used by file_io(), 1 and 2 by block_read()/block_write() and what they call
+	static char* bounce_get(size_t n, int slot = 0){
+		static thread_local Bounce bs[3];
+		Bounce& b = bs[slot];
+		size_t pages = (n + X_PAGE_SIZE-1) >> 16;
+		if(n > BOUNCE_KEEP) return (char*) x_pagealloc(pages);
+		if(pages > b.pages){
+			if(b.buf) x_pagefree(b.buf, b.pages);
+			b.buf = (char*) x_pagealloc(pages);
+			b.pages = b.buf ? pages : 0;
+		}
+		return b.buf;
+	}
+	static void bounce_put(char* buf, size_t n){
+		if(n > BOUNCE_KEEP) x_pagefree(buf, (n + X_PAGE_SIZE-1) >> 16);
+	}
+	// x_read()/x_write() on a bucket file. Direct I/O files need aligned offsets, sizes and buffers, anything else goes through a bounce buffer
+	// Aligned requests take the zero-copy path. Blocks never share a page in direct buckets, so partial pages can be read-modify-written as long as writes to the same block are serialized, see block_write()
+	size_t file_io(Bucket& bk, file_t fd, bool write, void* buf, uint64_t start, size_t len){
+		Clock::time_point t = Clock::now();
+		size_t done = direct_io_at(bk, fd, write, buf, start, len);
+		count_io(write, ns_since(t));
+		return done;
+	}
+	static size_t direct_io_at(Bucket& bk, file_t fd, bool write, void* buf, uint64_t start, size_t len){
+		if(!bk.direct || !((uintptr_t(buf) | start | len) & (DIRECT_ALIGN-1)))
+			return write ? x_write(fd, buf, start, len) : x_read(fd, buf, start, len);
+		uint64_t lo = start & ~(DIRECT_ALIGN-1), hi = (start + len + DIRECT_ALIGN-1) & ~(DIRECT_ALIGN-1);
+		char* b = bounce_get(hi - lo);
+		if(!b) return 0;
+		size_t done = 0;
+		if(!write){
+			if(x_read(fd, b, lo, hi - lo) >= hi - lo){
+				memcpy(buf, b + (start - lo), len);
+				done = len;
+			}
+		}else if((start == lo || x_read(fd, b, lo, DIRECT_ALIGN) >= DIRECT_ALIGN)
+			&& (start + len == hi || x_read(fd, b + (hi - lo - DIRECT_ALIGN), hi - DIRECT_ALIGN, DIRECT_ALIGN) >= DIRECT_ALIGN)){
+			memcpy(b + (start - lo), buf, len);
+			if(x_write(fd, b, lo, hi - lo) >= hi - lo) done = len;
+		}
+		bounce_put(b, hi - lo);
+		return done;
+	}
+
+	// Entry i of a checksum side table covers block i of the bucket file, network-endian [1:32] [crc32c:32] of its (uncompressed) contents. Entries of 0 (never written) are unknown and not verified
+	bool checksums = false;
+	std::atomic<uint64_t> checksum_errors = 0;
+	static uint64_t crc_entry(const void* data, size_t size){ return htonll(uint64_t(1) << 32 | x_crc32c(0, data, size)); }
+	// Entry i of a compressed length side table is the network-endian length of the compressed data at the start of block i, or 0 if the block is stored as is
+	// The rest of a compressed block is punched, so it takes no disk space where holes are supported
+	uint64_t compress_min = 0;
+	static constexpr uint64_t PUNCH_ALIGN = 4096;
+	// Writes to blocks with side tables lock the block, as they must update the data and its entries together, and a partial write must checksum or compress the whole block. So do unaligned writes to direct I/O files. Reads only lock to retry a mismatch, which may just be a racing write
+	static constexpr int BLOCK_LOCKS = 64;
+	std::mutex block_locks[BLOCK_LOCKS];
+	static int block_stripe(uint64_t ptr){ return (ptr >> 8) * 0x9E3779B97F4A7C15 >> 58; }
+	std::mutex& block_lock(uint64_t ptr){ return block_locks[block_stripe(ptr)]; }
+	// Side tables are accessed through a mapping, so that keeping them costs no syscalls. `block` is the byte offset of the block in the bucket file
+	uint64_t* side_slot(SideTable& t, int bucket, uint64_t block){
+		uint64_t i = block / bucket_size(bucket);
+		Map* m = t.map.load(memory_order::acquire);
+		if(!m || m->pages << 13 <= i){
+			std::lock_guard _(t.lock);
+			m = t.map.load(memory_order::relaxed);
+			if(!m || m->pages << 13 <= i){
+				// The file is grown first, touching a mapping past its end would SIGBUS
+				size_t pages = std::max<size_t>((i >> 13) + 1, m ? m->pages*2 : 1);
+				if(x_getsize(t.fd) < pages << 16 && !x_setsize(t.fd, pages << 16)) return 0;
+				char* base = (char*) x_mapfile(t.fd, 0, pages, false);
+				if(!base) return 0;
+				t.map.store(m = new Map{base, pages, m}, memory_order::release);
+			}
+		}
+		return (uint64_t*) m->base + i;
+	}
+	void side_put(SideTable& t, int bucket, uint64_t block, uint64_t entry){
+		if(uint64_t* slot = side_slot(t, bucket, block)) std::atomic_ref(*slot).store(entry, memory_order::relaxed);
+	}
+	uint64_t side_get(SideTable& t, int bucket, uint64_t block){
+		uint64_t* slot = side_slot(t, bucket, block);
+		return slot ? std::atomic_ref(*slot).load(memory_order::relaxed) : 0;
+	}
+	static bool plain(Bucket& bk){ return bk.crc.fd == X_FILE_T_INVALID && bk.zlen.fd == X_FILE_T_INVALID; }
+	// For blocks that now read as zeros (punched, or past the end of the file), which their old entries would not match
+	void side_clear(Bucket& bk, int bucket, uint64_t block){
+		if(bk.crc.fd != X_FILE_T_INVALID) side_put(bk.crc, bucket, block, 0);
+		if(bk.zlen.fd != X_FILE_T_INVALID) side_put(bk.zlen, bucket, block, 0);
+	}
+	// Read a whole block into b, decompressing it if needed. Data that fails to decompress sets errno to EBADMSG
+	bool block_load(Bucket& bk, int bucket, file_t fd, uint64_t block, char* b){
+		size_t size = bucket_size(bucket);
+		uint64_t z = bk.zlen.fd != X_FILE_T_INVALID ? ntohll(side_get(bk.zlen, bucket, block)) : 0;
+		if(!z || z >= size) return file_io(bk, fd, false, b, block, size) >= size;
+		char* c = bounce_get(z, 2);
+		if(!c || file_io(bk, fd, false, c, block, z) < z){
+			if(c) bounce_put(c, z);
+			return false;
+		}
+		bool ok = lz_decompress(c, z, b, size) == size;
+		bounce_put(c, z);
+		if(!ok) errno = EBADMSG;
+		return ok;
+	}
+	// Write a whole block from data, compressed if the bucket is and that saves at least 1/8th
+	bool block_store(Bucket& bk, int bucket, file_t fd, uint64_t block, const char* data){
+		size_t size = bucket_size(bucket);
+		if(bk.zlen.fd == X_FILE_T_INVALID) return file_io(bk, fd, true, (void*) data, block, size) >= size;
+		char* c = bounce_get(size, 2);
+		size_t z = c ? lz_compress(data, size, c, size - size/8) : 0;
+		uint64_t was = ntohll(side_get(bk.zlen, bucket, block));
+		bool ok = z ? file_io(bk, fd, true, c, block, z) >= z : file_io(bk, fd, true, (void*) data, block, size) >= size;
+		if(c) bounce_put(c, size);
+		if(!ok) return false;
+		side_put(bk.zlen, bucket, block, htonll(z));
+		// Release the space past the end of the new data
+		uint64_t used = z ? (z + PUNCH_ALIGN-1) & ~(PUNCH_ALIGN-1) : size, had = was ? (was + PUNCH_ALIGN-1) & ~(PUNCH_ALIGN-1) : size;
+		if(used < had) x_punch(fd, block + used, had - used);
+		return true;
+	}
+	// file_io() of part of a block. With side tables, the whole block is read (and decompressed) to verify it
+	bool block_read(Bucket& bk, int bucket, file_t fd, uint64_t block, uint64_t off, void* buf, size_t len){
+		if(plain(bk)) return file_io(bk, fd, false, buf, block + off, len) >= len;
+		size_t size = bucket_size(bucket);
+		char* b = len == size ? (char*) buf : bounce_get(size, 1);
+		if(!b) return false;
+		bool corrupt = false;
+		auto load = [&]{
+			errno = 0;
+			if(!block_load(bk, bucket, fd, block, b)) return !(corrupt = errno == EBADMSG);
+			uint64_t entry = bk.crc.fd != X_FILE_T_INVALID ? side_get(bk.crc, bucket, block) : 0;
+			return !(corrupt = entry && entry != crc_entry(b, size));
+		};
+		bool ok = load();
+		if(!ok){
+			std::lock_guard _(block_lock(block | bucket));
+			if(!(ok = load()) && corrupt){
+				checksum_errors.fetch_add(1, memory_order::relaxed);
+				errno = EBADMSG;
+			}
+		}
+		if(b != buf){
+			if(ok) memcpy(buf, b + off, len);
+			bounce_put(b, size);
+		}
+		return ok;
+	}
+	// file_io() of part of a block, then updating its side table entries. Compressed blocks are always rewritten whole
+	bool block_write(Bucket& bk, int bucket, file_t fd, uint64_t block, uint64_t off, const void* buf, size_t len){
+		if(plain(bk)){
+			// Unaligned writes to direct I/O files read-modify-write their first and last sectors, so two of them to disjoint parts of a sector would lose one
+			if(!bk.direct || !((off | len) & (DIRECT_ALIGN-1))) return file_io(bk, fd, true, (void*) buf, block + off, len) >= len;
+			std::lock_guard _(block_lock(block | bucket));
+			return file_io(bk, fd, true, (void*) buf, block + off, len) >= len;
+		}
+		size_t size = bucket_size(bucket);
+		std::lock_guard _(block_lock(block | bucket));
+		const char* data = (const char*) buf;
+		char* b = 0;
+		if(len == size){
+			if(!block_store(bk, bucket, fd, block, data)) return false;
+		}else if(bk.zlen.fd == X_FILE_T_INVALID){
+			if(file_io(bk, fd, true, (void*) buf, block + off, len) < len) return false;
+			// The write itself went through, so a block that can't be read back just loses its checksum
+			if((b = bounce_get(size, 1)) && file_io(bk, fd, false, b, block, size) < size){
+				bounce_put(b, size);
+				b = 0;
+			}
+			data = b;
+		}else{
+			if(!(b = bounce_get(size, 1))) return false;
+			bool ok = block_load(bk, bucket, fd, block, b);
+			if(ok){
+				memcpy(b + off, buf, len);
+				ok = block_store(bk, bucket, fd, block, b);
+			}
+			if(!ok){
+				bounce_put(b, size);
+				return false;
+			}
+			data = b;
+		}
+		if(bk.crc.fd != X_FILE_T_INVALID) side_put(bk.crc, bucket, block, data ? crc_entry(data, size) : 0);
+		if(b) bounce_put(b, size);
+		return true;
+	}
+
+	// Group commit: sequence numbers are epochs only advanced by the sync thread, right before it flushes
+	// Every operation that completed before seq() returned s is therefore covered by the first flush that starts after the epoch moves past s
+	std::atomic<uint64_t> epoch = 1;
+	// Guarded by sync_lock
+	uint64_t durable = 0, wanted = 0;
+	bool sync_stop = false;
+	struct Callback{
+		uint64_t seq;
+		void (*cb)(void*);
+		void* arg;
+	};
+	std::vector<Callback> callbacks;
+	std::mutex sync_lock;
+	std::condition_variable sync_wake, sync_done;
+	std::thread sync_thread;
+	// Requests arriving while a flush is in progress are all served by the next one
+	void sync_loop(){
+		std::unique_lock lk(sync_lock);
+		while(true){
+			sync_wake.wait(lk, [&]{ return sync_stop || wanted > durable; });
+			if(wanted <= durable) break;
+			uint64_t target = epoch.fetch_add(1, memory_order::acq_rel);
+			lk.unlock();
+			flush(false);
+			lk.lock();
+			durable = target;
+			sync_done.notify_all();
+			std::vector<Callback> ready;
+			std::erase_if(callbacks, [&](Callback& c){
+				if(c.seq > durable) return false;
+				ready.push_back(c);
+				return true;
+			});
+			if(ready.empty()) continue;
+			lk.unlock();
+			for(Callback& c : ready) c.cb(c.arg);
+			lk.lock();
+		}
+	}
+	// Must be called with sync_lock held
+	void request_sync(uint64_t s){
+		if(s <= wanted) return;
+		wanted = s;
+		if(!sync_thread.joinable()) sync_thread = std::thread(&BasicAllocDB::sync_loop, this);
+		sync_wake.notify_one();
+	}
 	public: void flush(){ flush(false); }
-	~AllocDB(){ flush(true); }
+	// The sync thread would be waiting for itself
+	void on_sync_thread(const char* what){
+		if(std::this_thread::get_id() != sync_thread.get_id()) return;
+		errno = EDEADLK;
+		perror((std::string("AllocDB: ") + what + " called from an on_durable() callback").c_str());
+		abort();
+	}
+	~BasicAllocDB(){
+		on_sync_thread("destructor");
+		async_stop();
+		{
+			std::lock_guard _(sync_lock);
+			sync_stop = true;
+			sync_wake.notify_one();
+		}
+		if(sync_thread.joinable()) sync_thread.join();
+		for(std::thread& t : loaders) t.join();
+		flush(true);
+		{
+			std::lock_guard _(dir_sync_lock);
+			dir_sync_stop = true;
+			dir_sync_wake.notify_all();
+		}
+		for(std::thread& t : dir_syncs) t.join();
+		unmap_frees();
+		delete[] cache;
+	}
+	struct CacheStats{
+		uint64_t hits, misses, size;
+	};
+	// Hit/miss counters and current size in bytes of the built-in block cache
+	CacheStats cache_stats(){
+		CacheStats st = {0, 0, 0};
+		if(cache) for(int i = 0; i < CACHE_SHARDS; i++){
+			CacheShard& sh = cache[i];
+			st.hits += sh.hits.load(memory_order::relaxed);
+			st.misses += sh.misses.load(memory_order::relaxed);
+			std::lock_guard _(sh);
+			st.size += sh.bytes[T1] + sh.bytes[T2];
+		}
+		return st;
+	}
+	struct BucketStats{
+		// Size of blocks in this bucket
+		uint64_t block_size;
+		// Operations since the db was opened
+		uint64_t allocs, frees, reads, writes, bytes_read, bytes_written;
+		// live_blocks: allocated blocks. free_blocks: freed blocks waiting to be reused, including ones cached by threads
+		uint64_t live_blocks, free_blocks;
+		// file_size: size of the file on disk, including preallocated space. used_bytes: space taken by live and free blocks
+		uint64_t file_size, used_bytes;
+		// Number of times and total time the bucket's lock had to be waited for
+		uint64_t lock_waits, lock_wait_ns;
+	};
+	struct Stats{
+		BucketStats buckets[MAX_BUCKETS];
+		uint64_t master_lock_waits, master_lock_wait_ns;
+		// Total and longest flush duration
+		uint64_t flushes, checkpoints, flush_ns, flush_max_ns;
+		// Latency histograms of bucket file I/O. Bin i counts operations that took [2^i, 2^(i+1)) ns
+		uint64_t read_latency[LATENCY_BINS], write_latency[LATENCY_BINS];
+		// Reads that failed checksum verification
+		uint64_t checksum_errors;
+		// free()s of blocks or small objects that were already free, which are ignored
+		uint64_t double_frees;
+		// Write backs of dirty cached blocks that failed, see Options::write_back. Those still failing when closing are dropped
+		uint64_t writeback_errors;
+	};
+	// Counters are read without stopping other threads, so they are not an exact point in time snapshot
+	Stats stats(){
+		Stats st;
+		memset(&st, 0, sizeof(st));
+		for(int i = 0; i < STAT_SHARDS; i++){
+			StatShard& sh = stat_shards[i];
+			for(int bucket = 0; bucket < MAX_BUCKETS; bucket++){
+				BucketStats& b = st.buckets[bucket];
+				auto& ops = sh.ops[bucket];
+				b.allocs += ops[STAT_ALLOC].load(memory_order::relaxed);
+				b.frees += ops[STAT_FREE].load(memory_order::relaxed);
+				b.reads += ops[STAT_READ].load(memory_order::relaxed);
+				b.writes += ops[STAT_WRITE].load(memory_order::relaxed);
+				b.bytes_read += ops[STAT_BYTES_READ].load(memory_order::relaxed);
+				b.bytes_written += ops[STAT_BYTES_WRITTEN].load(memory_order::relaxed);
+			}
+			for(int j = 0; j < LATENCY_BINS; j++){
+				st.read_latency[j] += sh.latency[0][j].load(memory_order::relaxed);
+				st.write_latency[j] += sh.latency[1][j].load(memory_order::relaxed);
+			}
+		}
+		{
+			std::lock_guard _(cache_lock);
+			for(ThreadCache* tc : caches){
+				std::lock_guard _(*tc);
+				for(int bucket = 0; bucket < MAX_BUCKETS; bucket++) st.buckets[bucket].free_blocks += tc->mags[bucket].size();
+			}
+		}
+		for(int bucket = 0; bucket < MAX_BUCKETS; bucket++){
+			BucketStats& b = st.buckets[bucket];
+			b.block_size = bucket_size(bucket);
+			Bucket* b_arr = fds[bucket>>3].load(memory_order::acquire);
+			if(!b_arr) continue;
+			Bucket& bk = b_arr[bucket&7];
+			b.lock_waits = bk.waits.load(memory_order::relaxed);
+			b.lock_wait_ns = bk.wait_ns.load(memory_order::relaxed);
+			std::lock_guard _(bk);
+			bk.load_free();
+			bool open = bk.fd.load(memory_order::relaxed) != X_FILE_T_INVALID;
+			// Unopened buckets are left alone, opening one would create its file
+			if(!open && bk.end == uint64_t(-1) && !bk.free.count) continue;
+			b.file_size = open ? bk.cap : x_stat(bk.path.c_str()).size;
+			b.used_bytes = bk.end == uint64_t(-1) ? b.file_size : bk.end;
+			b.free_blocks += bk.free.count;
+			b.live_blocks = b.used_bytes / b.block_size - std::min(b.free_blocks, b.used_bytes / b.block_size);
+		}
+		st.checksum_errors = checksum_errors.load(memory_order::relaxed);
+		st.double_frees = double_frees.load(memory_order::relaxed);
+		st.writeback_errors = writeback_errors.load(memory_order::relaxed);
+		st.master_lock_waits = master_lock.waits.load(memory_order::relaxed);
+		st.master_lock_wait_ns = master_lock.wait_ns.load(memory_order::relaxed);
+		std::lock_guard _(master_lock);
+		st.flushes = flushes;
+		st.checkpoints = checkpoints;
+		st.flush_ns = flush_ns;
+		st.flush_max_ns = flush_max_ns;
+		return st;
+	}
+	uint64_t seq(){ return epoch.load(memory_order::acquire); }
+	void wait_durable(uint64_t s){
+		on_sync_thread("wait_durable()");
+		std::unique_lock lk(sync_lock);
+		request_sync(s);
+		sync_done.wait(lk, [&]{ return durable >= s; });
+	}
+	void on_durable(uint64_t s, void (*cb)(void*), void* arg){
+		std::unique_lock lk(sync_lock);
+		if(durable >= s){
+			lk.unlock();
+			cb(arg);
+			return;
+		}
+		callbacks.push_back({s, cb, arg});
+		request_sync(s);
+	}
 	static uint64_t size_of(uint64_t ptr){
 		int bucket = ptr & 0xFF;
-		return bucket >= MAX_BUCKETS ? 0 : uint64_t(SMALLEST_BUCKET | (bucket&3)<<BUCKET0_OFFSET) << bucket*4;
+		if(is_small(ptr)) return SMALL_SIZES[bucket - SMALL_TAG];
+		return bucket >= MAX_BUCKETS ? 0 : bucket_size(bucket);
+	}
+	static uint64_t slab_of(uint64_t ptr, uint64_t& off){
+		if(!is_small(ptr)){
+			off = 0;
+			return ptr;
+		}
+		off = small_slot(ptr) * SMALL_SIZES[(ptr & 0xFF) - SMALL_TAG];
+		return small_slab(ptr);
 	}
 	// 
 	uint64_t alloc(uint64_t& size){
-		int bucket = 0;
-		if(size > SMALLEST_BUCKET){
-			int a = std::max(53 - std::countl_zero(size-1), 0);
-			bucket = (a<<2|((size-1)>>(a+BUCKET0_OFFSET)&3))+1;
+		if(SMALL_CLASSES && size <= SMALL_MAX){
+			int c = 0;
+			while(SMALL_SIZES[c] < size) c++;
+			size = SMALL_SIZES[c];
+			return alloc_small(c);
 		}
+		int bucket = bucket_for(size);
 		if(bucket >= MAX_BUCKETS) return -1;
-		size = uint64_t(SMALLEST_BUCKET | (bucket&3)<<BUCKET0_OFFSET) << bucket*4;
+		size = bucket_size(bucket);
 
-		auto& atm = fds[bucket>>3];
-		Bucket* b_arr = atm.load(memory_order::acquire);
-		if(!b_arr){
-			std::lock_guard _(master_lock);
-			if(!(b_arr = atm.load(memory_order::acquire)))
-				atm.store(b_arr = new Bucket[TOP_ARRAY_LEN](), memory_order::release);
+		Bucket& bk = get_bucket(bucket);
+		count(bucket, STAT_ALLOC);
+		ThreadCache& tc = thread_cache();
+		std::lock_guard _(tc);
+		auto& mag = tc.mags[bucket];
+		if(mag.empty()){
+			std::lock_guard _(bk);
+			bk.load_free();
+			// The lowest free blocks, pushed highest first so that they are handed out in address order
+			uint64_t take[MAGAZINE_BATCH];
+			size_t n = 0;
+			for(uint64_t i = 0; n < MAGAZINE_BATCH && (i = bk.free.next(i)) != uint64_t(-1); i++) take[n++] = i;
+			while(n--){
+				bk.take(take[n]);
+				mag.push_back(bk.id(take[n]));
+				bk.note(mag.back() | USED_BIT);
+			}
+			if(mag.empty()){
+				if(!grow(bk, bucket, size)) return -1;
+				uint64_t a = bk.end;
+				bk.end = a + size;
+				return a | bucket;
+			}
 		}
-		Bucket& bk = b_arr[bucket&7];
+		uint64_t a = mag.back();
+		mag.pop_back();
+		bk.is_free.clear(bk.index(a));
+		return a;
+	}
+	// Allocate `n` blocks of at least `size` bytes each that are adjacent on disk, so that they can be laid out sequentially. `size` is updated like by alloc(), but is never rounded to a small object class
+	// Returns the ID of the first block, the others follow `size` bytes apart, or -1 on failure. Each block is then an ordinary block, freed on its own
+	uint64_t alloc_contiguous(uint64_t& size, uint64_t n){
+		int bucket = bucket_for(size);
+		if(bucket >= MAX_BUCKETS || !n) return -1;
+		size = bucket_size(bucket);
+		Bucket& bk = get_bucket(bucket);
 		std::lock_guard _(bk);
-		if(bk.free.size()){
-			uint64_t a = ntohll(bk.free.back());
-			bk.free.pop_back();
-			return a | bucket;
+		bk.load_free();
+		uint64_t i = bk.free.find_run(n), fresh = 0;
+		if(i == uint64_t(-1)){
+			// At the end of the file, taking in any free blocks right before it
+			if(!bk.check_init()) return -1;
+			i = bk.end / size;
+			uint64_t reused = 0;
+			while(i && reused < n && bk.free.test(i-1)) i--, reused++;
+			fresh = n - reused;
+			if(!grow(bk, bucket, fresh * size)) return -1;
+		}
+		for(uint64_t k = 0; k < n - fresh; k++){
+			bk.take(i + k);
+			bk.is_free.clear(i + k);
+			bk.note(bk.id(i + k) | USED_BIT);
 		}
-		if(!bk.check_init(prefix, bucket)) return -1;
-		uint64_t a = bk.end;
-		x_setsize(bk.fd, bk.end += size);
-		return a | bucket;
+		bk.end += fresh * size;
+		for(uint64_t k = 0; k < n; k++) count(bucket, STAT_ALLOC);
+		return bk.id(i);
 	}
 	void free(uint64_t ptr){
+		if(is_small(ptr)) return free_small(ptr);
 		int bucket = ptr & 0xFF;
 		if(bucket >= MAX_BUCKETS) return;
+		Bucket& bk = get_bucket(bucket);
+		if(!mark_free(bk, ptr)) return;
+		count(bucket, STAT_FREE);
+		cache_drop(ptr, false);
+		// The block is still ours until it is pushed, so no lock is needed
+		if(bucket_size(bucket) >= punch_min.load(memory_order::relaxed) && !punch_deferred.load(memory_order::relaxed)){
+			file_t fd = bk.get_fd();
+			if(fd != X_FILE_T_INVALID){
+				x_punch(fd, ptr & ~uint64_t(0xFF), bucket_size(bucket));
+				side_clear(bk, bucket, ptr & ~uint64_t(0xFF));
+				bk.touch();
+			}
+		}
+		ThreadCache& tc = thread_cache();
+		std::lock_guard _(tc);
+		auto& mag = tc.mags[bucket];
+		mag.push_back(ptr);
+		if(mag.size() > MAGAZINE_SIZE){
+			std::lock_guard _(bk);
+			for(size_t i = mag.size() - MAGAZINE_BATCH; i < mag.size(); i++){
+				bk.put(bk.index(mag[i]));
+				bk.note(mag[i]);
+			}
+			mag.resize(mag.size() - MAGAZINE_BATCH);
+		}
+	}
+	// Resize a block to at least `size` bytes, keeping its contents up to the smaller of the two sizes. `size` is updated like by alloc()
+	// If the new size is in the same size class, ptr itself is returned. Otherwise the data is moved to a newly allocated block, preferably in the kernel (see x_copy()), ptr is freed, and the new ID is returned
+	// Returns -1 on failure, in which case ptr is left as it was
+	uint64_t realloc(uint64_t ptr, uint64_t& size){
+		uint64_t old = size_of(ptr);
+		if(!old) return -1;
+		// Where alloc() would put it
+		bool same;
+		if(SMALL_CLASSES && size <= SMALL_MAX){
+			int c = 0;
+			while(SMALL_SIZES[c] < size) c++;
+			same = is_small(ptr) && int(ptr & 0xFF) - SMALL_TAG == c;
+		}else same = !is_small(ptr) && bucket_for(size) == int(ptr & 0xFF);
+		if(same){
+			size = old;
+			return ptr;
+		}
+		uint64_t to = alloc(size);
+		if(to == uint64_t(-1)) return -1;
+		if(!copy_block(ptr, to, std::min(old, size))){
+			free(to);
+			return -1;
+		}
+		free(ptr);
+		return to;
+	}
+	private:
+	// Piece size of copy_block() when it can't leave the copy to the kernel
+	static constexpr size_t COPY_CHUNK = 1 << 20;
+	// Copy the first `len` bytes of block `from` to block `to`. Plain buckets are copied file to file, others need their side tables updated and go through memory
+	bool copy_block(uint64_t from, uint64_t to, uint64_t len){
+		uint64_t from_off, to_off;
+		uint64_t from_slab = slab_of(from, from_off), to_slab = slab_of(to, to_off);
+		Bucket& fk = get_bucket(from_slab & 0xFF);
+		Bucket& tk = get_bucket(to_slab & 0xFF);
+		uint64_t start = (from_slab & ~uint64_t(0xFF)) + from_off, dest = (to_slab & ~uint64_t(0xFF)) + to_off;
+		// Direct I/O files take only aligned ranges, even in the kernel
+		bool aligned = !((fk.direct || tk.direct) && ((start | dest | len) & (DIRECT_ALIGN-1)));
+		if(!plain(fk) || !plain(tk) || !aligned){
+			// Copied a piece at a time through a bounded buffer. Buckets with side tables load and store whole blocks on every partial access, so those are copied in one piece
+			size_t chunk = plain(fk) && plain(tk) ? std::min<uint64_t>(len, COPY_CHUNK) : len, pages = (chunk + X_PAGE_SIZE-1) >> 16;
+			char* buf = (char*) x_pagealloc(pages);
+			bool ok = buf;
+			for(uint64_t off = 0; ok && off < len; off += chunk){
+				size_t n = std::min<uint64_t>(chunk, len - off);
+				ok = read_at(from, off, n, buf) && write_at(to, off, n, buf);
+			}
+			if(buf) x_pagefree(buf, pages);
+			return ok;
+		}
+		WriteGuard guard(tk, to_slab & ~uint64_t(0xFF));
+		if(!guard.ok) return false;
+		// The files must hold the latest data of both, and neither may be cached afterwards. The rest of a cached slab is written back too
+		cache_drop(from_slab, true);
+		cache_drop(to_slab, true);
+		file_t ffd = fk.get_fd(), tfd = tk.get_fd();
+		if(ffd == X_FILE_T_INVALID || tfd == X_FILE_T_INVALID) return false;
+		count(from_slab & 0xFF, STAT_READ, len);
+		count(to_slab & 0xFF, STAT_WRITE, len);
+		bool ok = x_copy(ffd, start, tfd, dest, len) >= len;
+		// Once copied, see write_at()
+		tk.touch();
+		return ok;
+	}
+	// Bucket # for blocks of at least `size` bytes. MAX_BUCKETS or more if there is none
+	static int bucket_for(uint64_t size){
+		if(size <= SMALLEST_BUCKET) return 0;
+		int a = std::max(63 - BUCKET0_OFFSET - STEP_BITS - std::countl_zero(size-1), 0);
+		return (a << STEP_BITS | ((size-1) >> (a+BUCKET0_OFFSET) & ((1 << STEP_BITS) - 1))) + 1;
+	}
+	// Make sure the file has room for `need` more bytes past `end`. Must be called with the bucket locked
+	bool grow(Bucket& bk, int bucket, uint64_t need){
+		if(!bk.check_init()) return false;
+		uint64_t a = bk.end, size = bucket_size(bucket);
+		if(a + need > bk.cap){
+			// Grow geometrically, so bulk loads need few metadata syscalls and get contiguous extents
+			uint64_t ext = std::max(need, std::min(std::max(bk.cap, size*MIN_EXTENT_BLOCKS), MAX_EXTENT));
+			ext = std::max(need, ext / size * size);
+			if(!x_allocate(bk.fd, bk.cap, a + ext - bk.cap)){
+				ext = need;
+				if(!x_allocate(bk.fd, bk.cap, a + ext - bk.cap)) return false;
+			}
+			bk.cap = a + ext;
+			bk.touch();
+		}
+		return true;
+	}
+	std::atomic<uint64_t> double_frees = 0;
+	// Mark a block free, or return false if it already was. Double frees are ignored, and only counted
+	// Whether block i is below the end of the bucket, i.e was ever allocated. Blocks past it are obviously invalid
+	bool below_end(Bucket& bk, uint64_t i){
+		bk.ensure_loaded();
+		if(i >= bk.limit.load(memory_order::relaxed)){
+			std::lock_guard _(bk);
+			if(!bk.check_init() || i >= bk.end / bk.size) return false;
+			if(bk.limit.load(memory_order::relaxed) < bk.end / bk.size) bk.limit.store(bk.end / bk.size, memory_order::relaxed);
+		}
+		return true;
+	}
+	bool mark_free(Bucket& bk, uint64_t ptr){
+		uint64_t i = bk.index(ptr);
+		if(!below_end(bk, i)) return false;
+		if(!bk.is_free.set(i)) return true;
+		double_frees.fetch_add(1, memory_order::relaxed);
+		return false;
+	}
+	public:
+	bool read(uint64_t ptr, void* buf){ return read_at(ptr, 0, size_of(ptr), buf); }
+	bool write(uint64_t ptr, const void* buf){ return write_at(ptr, 0, size_of(ptr), buf); }
+	bool read_at(uint64_t ptr, uint64_t off, uint64_t len, void* buf){
+		uint64_t size = size_of(ptr), in_slab;
+		if(!size || off > size || len > size-off) return false;
+		// Small objects are read and written as part of their slab
+		ptr = slab_of(ptr, in_slab);
+		off += in_slab;
+		int bucket = ptr & 0xFF;
 		ptr &= ~uint64_t(0xFF);
-		Bucket* b_arr = fds[bucket>>3].load(memory_order::acquire);
-		if(!b_arr) return;
-		Bucket& bk = b_arr[bucket&7];
-		std::lock_guard _(bk);
-		bk.free.push_back(htonll(ptr));
+		size = bucket_size(bucket);
+		count(bucket, STAT_READ, len);
+
+		uint64_t writes = 0;
+		if(cache){
+			CacheShard& sh = cache_shard(ptr|bucket);
+			std::lock_guard _(sh);
+			auto it = sh.map.find(ptr|bucket);
+			if(it != sh.map.end() && it->second.data){
+				memcpy(buf, it->second.data + off, len);
+				cache_move(sh, ptr|bucket, it->second, T2);
+				sh.hits.fetch_add(1, memory_order::relaxed);
+				return true;
+			}
+			sh.misses.fetch_add(1, memory_order::relaxed);
+			writes = sh.writes;
+		}
+		Bucket& bk = get_bucket(bucket);
+		file_t fd = bk.get_fd();
+		if(fd == X_FILE_T_INVALID) return false;
+		if(!block_read(bk, bucket, fd, ptr, off, buf, len)) return false;
+		// Only whole blocks are cached. Blocks that may be written through a view_mut() are never cached
+		if(cache && len == size && !bk.mapped_mut.load(memory_order::relaxed)){
+			CacheShard& sh = cache_shard(ptr|bucket);
+			std::lock_guard _(sh);
+			if(sh.writes == writes) cache_insert(sh, ptr|bucket, size, buf, false);
+		}
+		return true;
 	}
-	bool read(uint64_t ptr, void* buf){
+	bool write_at(uint64_t ptr, uint64_t off, uint64_t len, const void* buf){
+		uint64_t size = size_of(ptr), in_slab;
+		if(!size || off > size || len > size-off) return false;
+		// Small objects are read and written as part of their slab
+		ptr = slab_of(ptr, in_slab);
+		off += in_slab;
 		int bucket = ptr & 0xFF;
-		if(bucket >= MAX_BUCKETS) return false;
 		ptr &= ~uint64_t(0xFF);
-		uint64_t size = uint64_t(SMALLEST_BUCKET | (bucket&3)<<BUCKET0_OFFSET) << (bucket>>2);
+		size = bucket_size(bucket);
+		count(bucket, STAT_WRITE, len);
 
-		Bucket* b_arr = fds[bucket>>3].load(memory_order::acquire);
-		if(!b_arr) return false;
-		Bucket& bk = b_arr[bucket&7];
+		Bucket& bk = get_bucket(bucket);
+		WriteGuard guard(bk, ptr);
+		if(!guard.ok) return false;
+		if(cache){
+			CacheShard& sh = cache_shard(ptr|bucket);
+			std::lock_guard _(sh);
+			sh.writes++;
+			auto it = sh.map.find(ptr|bucket);
+			if(it != sh.map.end() && it->second.data){
+				memcpy(it->second.data + off, buf, len);
+				cache_move(sh, ptr|bucket, it->second, T2);
+				if(write_back && !bk.mapped.load(memory_order::relaxed)) return it->second.dirty = true;
+			}else if(write_back && len == size && !bk.mapped.load(memory_order::relaxed) && size <= sh.cap >> 3){
+				cache_insert(sh, ptr|bucket, size, buf, true);
+				return true;
+			}
+		}
+		file_t fd = bk.get_fd();
+		if(fd == X_FILE_T_INVALID) return false;
+		bool ok = block_write(bk, bucket, fd, ptr, off, buf, len);
+		// Only once the data (and its side table entries) are written: a flush that clears the flag before then would not sync them
+		bk.touch();
+		return ok;
+	}
+	// Called by compact() after a live block has been copied from `from` to `to`. Return false to veto the move, in which case `from` stays where it is
+	typedef bool (*relocate_fn)(void* arg, uint64_t from, uint64_t to);
+	bool compact(relocate_fn cb, void* arg, size_t budget = 64){
+		std::lock_guard _(compact_lock);
+		{
+			std::lock_guard _(cache_lock);
+			drain_all(false);
+		}
+		for(int n = 0; n < MAX_BUCKETS && budget; n++){
+			int bucket = compact_cursor;
+			Bucket* b_arr = fds[bucket>>3].load(memory_order::acquire);
+			if(b_arr) budget -= compact_bucket(b_arr[bucket&7], bucket, cb, arg, budget);
+			if(budget) compact_cursor = (compact_cursor+1) % MAX_BUCKETS;
+		}
+		return !budget;
+	}
+	private:
+	std::mutex compact_lock;
+	// Guarded by compact_lock
+	int compact_cursor = 0;
+	// Trim free blocks off the end of the bucket and move live ones from the end into the lowest free slots, for at most `budget` blocks, then truncate the file (or punch its end, if it has views)
+	// The whole slice runs under the bucket lock, so magazines can only be refilled with blocks below the new end. The per-thread magazines keep most alloc()/free()s from noticing
+	// Writes to the blocks the slice may move wait for it (see WriteGuard), and the ones already under way are waited for first, outside the bucket lock so that they can finish
+	size_t compact_bucket(Bucket& bk, int bucket, relocate_fn cb, void* arg, size_t budget){
+		uint64_t size = bucket_size(bucket);
+		int slot;
+		{
+			std::lock_guard _(bk);
+			bk.load_free();
+			if(!bk.free.count || !bk.check_init()) return 0;
+			slot = bk.fence_off(bk.end - std::min(bk.end, budget * size));
+		}
+		bk.fence_wait(slot);
 		std::lock_guard _(bk);
-		if(!bk.check_init(prefix, bucket)) return false;
-		return x_read(bk.fd, buf, ptr, size) >= size;
+
+		size_t done = 0;
+		char* buf = 0;
+		for(; done < budget && bk.end; done++){
+			uint64_t from = bk.end - size;
+			// Free but in a magazine, taken there after compact() drained them. Trimming it would have the magazine hand out a block past the end, and the file grow over it again
+			if(!bk.free.test(from / size) && bk.is_free.test(from / size)) break;
+			if(!bk.free.test(from / size)){
+				// Bucket 0 blocks may be slabs, which small object IDs point into, so they are never moved. Nor are blocks of files written through view_mut(), which no lock can hold off
+				if(!bucket || bk.mapped_mut.load(memory_order::relaxed)) break;
+				uint64_t to = bk.free.next(0) * size;
+				if(to >= from) break;
+				if(!buf && !(buf = (char*) x_pagealloc((size + X_PAGE_SIZE-1) >> 16))) break;
+				cache_drop(from | bucket, true);
+				// Blocks are moved as stored, compressed or not. Checksums move along unverified, so a corrupt block stays detectably corrupt
+				uint64_t z = bk.zlen.fd != X_FILE_T_INVALID ? ntohll(side_get(bk.zlen, bucket, from)) : 0, n = z && z < size ? z : size;
+				if(file_io(bk, bk.fd, false, buf, from, n) < n || file_io(bk, bk.fd, true, buf, to, n) < n) break;
+				if(bk.crc.fd != X_FILE_T_INVALID) side_put(bk.crc, bucket, to, side_get(bk.crc, bucket, from));
+				if(bk.zlen.fd != X_FILE_T_INVALID){
+					uint64_t used = (n + PUNCH_ALIGN-1) & ~(PUNCH_ALIGN-1);
+					side_put(bk.zlen, bucket, to, htonll(z));
+					if(used < size) x_punch(bk.fd, to + used, size - used);
+				}
+				if(!cb(arg, from | bucket, to | bucket)) break;
+				bk.take(to / size);
+				bk.is_free.clear(to / size);
+				bk.note(to | bucket | USED_BIT);
+			}
+			bk.end = from;
+			// Blocks past the end read as zeros if the file grows back
+			side_clear(bk, bucket, from);
+		}
+		if(buf) x_pagefree(buf, (size + X_PAGE_SIZE-1) >> 16);
+		// Trimmed free blocks are no longer free, they are past the end
+		for(uint64_t i; (i = bk.free.next(bk.end / size)) != uint64_t(-1);){
+			bk.take(i);
+			bk.is_free.clear(i);
+			bk.note(bk.id(i) | USED_BIT);
+		}
+		if(done){
+			// Views stay valid after their block is freed, so a file that has any keeps its size, and its trimmed end is only punched
+			if(bk.mapped.load(memory_order::relaxed)) x_punch(bk.fd, bk.end, bk.cap - bk.end);
+			else{
+				x_setsize(bk.fd, bk.end);
+				bk.cap = bk.end;
+			}
+			bk.touch();
+		}
+		bk.fence.store(-1);
+		return done;
+	}
+	public:
+
+	void punch_holes(uint64_t min_size, bool deferred = false){
+		punch_deferred.store(deferred, memory_order::relaxed);
+		punch_min.store(min_size, memory_order::relaxed);
 	}
-	bool write(uint64_t ptr, const void* buf){
+	bool reclaim(size_t budget = 64){
+		uint64_t min_size = punch_min.load(memory_order::relaxed);
+		// Blocks sitting in magazines can't be punched
+		{
+			std::lock_guard _(cache_lock);
+			drain_all(false);
+		}
+		for(int bucket = MAX_BUCKETS-1; bucket >= 0 && bucket_size(bucket) >= min_size && budget; bucket--){
+			Bucket* b_arr = fds[bucket>>3].load(memory_order::acquire);
+			if(!b_arr) continue;
+			Bucket& bk = b_arr[bucket&7];
+			// Held throughout so that no block can be allocated while its hole is being punched
+			std::lock_guard _(bk);
+			bk.load_free();
+			if(!bk.unpunched.count || !bk.check_init()) continue;
+			for(uint64_t i = 0; budget && (i = bk.unpunched.next(i)) != uint64_t(-1); budget--){
+				bk.unpunched.clear(i);
+				x_punch(bk.fd, i * bk.size, bk.size);
+				side_clear(bk, bucket, i * bk.size);
+			}
+			bk.touch();
+		}
+		return !budget;
+	}
+	private:
+	std::atomic<uint64_t> punch_min = -1;
+	std::atomic<bool> punch_deferred = false;
+	public:
+
+	// A span of memory directly mapped to a block. See view()
+	template<typename T>
+	struct View{
+		T* data = 0;
+		uint64_t size = 0;
+		T* begin() const{ return data; }
+		T* end() const{ return data + size; }
+		explicit operator bool() const{ return data; }
+	};
+	View<const char> view(uint64_t ptr){
+		View<char> v = map_block(ptr);
+		return {v.data, v.size};
+	}
+	View<char> view_mut(uint64_t ptr){
+		View<char> v = map_block(ptr);
+		if(!v) return v;
+		uint64_t off, block = slab_of(ptr, off);
+		Bucket& bk = get_bucket(block & 0xFF);
+		bk.mapped_mut.store(true, memory_order::relaxed);
+		// Writes through the mapping can't be checksummed, so the block has none until its next write()
+		if(bk.crc.fd != X_FILE_T_INVALID){
+			std::lock_guard _(block_lock(block));
+			side_put(bk.crc, block & 0xFF, block & ~uint64_t(0xFF), 0);
+		}
+		return v;
+	}
+	private: View<char> map_block(uint64_t ptr){
+		if(is_small(ptr)){
+			uint64_t off;
+			View<char> v = map_block(slab_of(ptr, off));
+			return v ? View<char>{v.data + off, size_of(ptr)} : View<char>{};
+		}
 		int bucket = ptr & 0xFF;
-		if(bucket >= MAX_BUCKETS) return false;
+		if(bucket >= MAX_BUCKETS) return {};
+		cache_drop(ptr, true);
 		ptr &= ~uint64_t(0xFF);
-		uint64_t size = uint64_t(SMALLEST_BUCKET | (bucket&3)<<BUCKET0_OFFSET) << (bucket>>2);
+		uint64_t size = bucket_size(bucket), need = ptr + size;
 
-		Bucket* b_arr = fds[bucket>>3].load(memory_order::acquire);
-		if(!b_arr) return false;
-		Bucket& bk = b_arr[bucket&7];
-		std::lock_guard _(bk);
-		if(!bk.check_init(prefix, bucket)) return false;
-		return x_write(bk.fd, buf, ptr, size) >= size;
+		Bucket& bk = get_bucket(bucket);
+		// Compressed blocks can't be mapped
+		if(bk.get_fd() == X_FILE_T_INVALID || bk.zlen.fd != X_FILE_T_INVALID) return {};
+		bk.mapped.store(true, memory_order::relaxed);
+		Map* m = bk.map.load(memory_order::acquire);
+		if(!m || m->pages << 16 < need){
+			std::lock_guard _(bk);
+			if(!bk.check_init()) return {};
+			m = bk.map.load(memory_order::relaxed);
+			if(!m || m->pages << 16 < need){
+				// Past the end of the file, touching it would SIGBUS
+				if(need > bk.end) return {};
+				// Grow in big steps so remapping is rare
+				size_t pages = std::max<size_t>((need + X_PAGE_SIZE - 1) >> 16, m ? m->pages*2 : 16);
+				char* base = (char*) x_mapfile(bk.fd, 0, pages, false);
+				if(!base) return {};
+				bk.map.store(m = new Map{base, pages, m}, memory_order::release);
+			}
+		}
+		return {m->base + ptr, size};
 	}
-};
\ No newline at end of file
+	public:
+
+	// One entry of a read_many()/write_many() batch. `ok` is set to whether that entry succeeded
+	struct IO{
+		uint64_t ptr;
+		void* buf;
+		bool ok;
+	};
+	size_t read_many(IO* ios, size_t n){ return io_many(ios, n, false); }
+	size_t write_many(IO* ios, size_t n){ return io_many(ios, n, true); }
+	private:
+	// Each thread lazily sets up its own ring the first time it does a batch
+	struct Ring: x_ring_t{
+		Ring(){ x_ring_open(this, 256); }
+		~Ring(){ x_ring_close(this); }
+	};
+	size_t io_many(IO* ios, size_t n, bool write){
+		static thread_local Ring ring;
+		x_io_t stack_ops[64];
+		x_io_t* ops = n <= 64 ? stack_ops : (x_io_t*) malloc(n*sizeof(x_io_t));
+		// Unaligned buffers for direct I/O buckets are swapped for page aligned ones, and swapped back after the batch
+		bool bounced = false;
+		// With checksums, whole blocks are verified/checksummed after the batch. Small objects and compressed blocks are done one by one instead (see block_read()/block_write())
+		std::vector<size_t> partial;
+		// Checksummed writes hold their blocks' locks from before the data is written until its checksum is, like block_write(). Taken in stripe order, as several are held at once
+		uint64_t stripes = 0;
+		// WriteGuard slots of the writes in the batch. Writes to blocks compact() may be moving are done one by one instead
+		std::vector<int8_t> slots(write ? n : 0, -1);
+		for(size_t i = 0; i < n; i++){
+			uint64_t in_slab, ptr = slab_of(ios[i].ptr, in_slab);
+			int bucket = ptr & 0xFF;
+			x_io_t& op = ops[i];
+			op.fd = X_FILE_T_INVALID;
+			if(bucket < MAX_BUCKETS){
+				// Batches bypass the cache, which must not keep stale blocks or have dirty ones overwrite them later
+				if(write || write_back) cache_drop(ptr, !write);
+				Bucket& bk = get_bucket(bucket);
+				op.fd = bk.get_fd();
+				count(bucket, write ? STAT_WRITE : STAT_READ, size_of(ios[i].ptr));
+			}
+			op.buf = ios[i].buf;
+			op.start = (ptr & ~uint64_t(0xFF)) + in_slab;
+			op.count = bucket < MAX_BUCKETS ? size_of(ios[i].ptr) : 0;
+			op.write = write;
+			if(op.fd != X_FILE_T_INVALID && !plain(get_bucket(bucket)) && (op.count != bucket_size(bucket) || get_bucket(bucket).zlen.fd != X_FILE_T_INVALID)){
+				partial.push_back(i);
+				op.fd = X_FILE_T_INVALID;
+				continue;
+			}
+			if(write && op.fd != X_FILE_T_INVALID && (slots[i] = get_bucket(bucket).write_start(ptr & ~uint64_t(0xFF))) < 0){
+				partial.push_back(i);
+				op.fd = X_FILE_T_INVALID;
+				continue;
+			}
+			if(write && op.fd != X_FILE_T_INVALID && get_bucket(bucket).crc.fd != X_FILE_T_INVALID) stripes |= uint64_t(1) << block_stripe(ptr);
+			if(op.fd != X_FILE_T_INVALID && get_bucket(bucket).direct && (uintptr_t(op.buf) & (DIRECT_ALIGN-1))){
+				op.buf = x_pagealloc((op.count + X_PAGE_SIZE-1) >> 16);
+				if(!op.buf){ op.fd = X_FILE_T_INVALID; continue; }
+				if(write) memcpy(op.buf, ios[i].buf, op.count);
+				bounced = true;
+			}
+		}
+		for(uint64_t m = stripes; m; m &= m-1) block_locks[std::countr_zero(m)].lock();
+		Clock::time_point t = Clock::now();
+		x_batch(&ring, ops, n);
+		// Every operation in the batch waited for the whole batch
+		uint64_t ns = ns_since(t);
+		for(size_t i = 0; i < n; i++) if(ops[i].fd != X_FILE_T_INVALID) count_io(write, ns);
+		size_t good = 0;
+		for(size_t i = 0; i < n; i++){
+			ios[i].ok = ops[i].fd != X_FILE_T_INVALID && ops[i].result >= ops[i].count;
+			if(bounced && ops[i].buf && ops[i].buf != ios[i].buf){
+				if(!write && ios[i].ok) memcpy(ios[i].buf, ops[i].buf, ops[i].count);
+				x_pagefree(ops[i].buf, (ops[i].count + X_PAGE_SIZE-1) >> 16);
+			}
+			uint64_t in_slab, ptr = slab_of(ios[i].ptr, in_slab);
+			int bucket = ptr & 0xFF;
+			if(ios[i].ok && get_bucket(bucket).crc.fd != X_FILE_T_INVALID){
+				Bucket& bk = get_bucket(bucket);
+				uint64_t block = ptr & ~uint64_t(0xFF);
+				if(write) side_put(bk.crc, bucket, block, crc_entry(ios[i].buf, ops[i].count));
+				else{
+					uint64_t entry = side_get(bk.crc, bucket, block);
+					// Rechecked the slow way, which tells a racing write from corruption
+					if(entry && entry != crc_entry(ios[i].buf, ops[i].count)) ios[i].ok = block_read(bk, bucket, ops[i].fd, block, 0, ios[i].buf, ops[i].count);
+				}
+			}
+			good += ios[i].ok;
+		}
+		for(uint64_t m = stripes; m; m &= m-1) block_locks[std::countr_zero(m)].unlock();
+		for(size_t i = 0; i < slots.size(); i++){
+			uint64_t in_slab;
+			if(slots[i] >= 0) get_bucket(slab_of(ios[i].ptr, in_slab) & 0xFF).write_done(slots[i]);
+		}
+		for(size_t i : partial){
+			uint64_t in_slab, ptr = slab_of(ios[i].ptr, in_slab);
+			int bucket = ptr & 0xFF;
+			Bucket& bk = get_bucket(bucket);
+			if(!write){
+				good += ios[i].ok = block_read(bk, bucket, bk.fd, ptr & ~uint64_t(0xFF), in_slab, ios[i].buf, ops[i].count);
+				continue;
+			}
+			WriteGuard guard(bk, ptr & ~uint64_t(0xFF));
+			good += ios[i].ok = guard.ok && block_write(bk, bucket, bk.fd, ptr & ~uint64_t(0xFF), in_slab, ios[i].buf, ops[i].count);
+		}
+		// Once everything is written, see write_at()
+		if(write) for(size_t i = 0; i < n; i++){
+			uint64_t in_slab;
+			int bucket = slab_of(ios[i].ptr, in_slab) & 0xFF;
+			if(bucket < MAX_BUCKETS) get_bucket(bucket).touch();
+		}
+		if(ops != stack_ops) ::free(ops);
+		return good;
+	}
+
+	// Asynchronous I/O: operations are queued on a ring owned by the db, opened on first use, and completed by a thread of its own
+	// Operations that find the ring full wait in a backlog instead of blocking the caller, and are queued as earlier ones complete
+	public:
+	struct Async{
+		x_io_t io;
+		bool ok;
+		// Called once the operation is done, on the completion thread or on the thread that started it
+		void (*done)(Async*);
+		Clock::time_point start;
+		// WriteGuard slot of a write, released once it completes
+		int bucket, slot;
+	};
+	private:
+	static constexpr unsigned ASYNC_DEPTH = 1024;
+	// Both have their fd set to invalid by the constructor
+	x_ring_t async_ring{};
+	// Guarded by async_lock
+	std::mutex async_lock;
+	bool async_opened = false, async_stopping = false;
+	size_t async_inflight = 0;
+	std::deque<Async*> async_backlog;
+	x_io_t async_wake{};
+	std::thread async_thread;
+	// Start reading/writing the whole block at ptr into/from buf. Returns false if it was done synchronously instead (a.ok is then set, but a.done is not called), see async_read()
+	// As for read_many()/write_many(), the block cache is bypassed. Buckets with checksums or compression, unaligned buffers for direct I/O, and blocks too big for the ring are done synchronously
+	bool async_start(Async& a, uint64_t ptr, void* buf, bool write){
+		uint64_t in_slab, block = slab_of(ptr, in_slab);
+		int bucket = block & 0xFF;
+		if(!size_of(ptr) || bucket >= MAX_BUCKETS){
+			a.ok = false;
+			return false;
+		}
+		Bucket& bk = get_bucket(bucket);
+		file_t fd = bk.get_fd();
+		// Writes to blocks compact() may be moving wait for it, which write() does
+		a.slot = write && fd != X_FILE_T_INVALID ? bk.write_start(block & ~uint64_t(0xFF)) : -1;
+		if(fd == X_FILE_T_INVALID || !plain(bk) || (bk.direct && (uintptr_t(buf) & (DIRECT_ALIGN-1))) || size_of(ptr) > X_RING_MAX || (write && a.slot < 0)){
+			if(a.slot >= 0) bk.write_done(a.slot);
+			a.ok = write ? this->write(ptr, buf) : read(ptr, buf);
+			return false;
+		}
+		if(write || write_back) cache_drop(block, !write);
+		count(bucket, write ? STAT_WRITE : STAT_READ, size_of(ptr));
+		a.io = {fd, buf, (block & ~uint64_t(0xFF)) + in_slab, size_of(ptr), 0, write};
+		a.start = Clock::now();
+		a.bucket = bucket;
+		std::unique_lock lk(async_lock);
+		if(!async_opened){
+			async_opened = true;
+			if(x_ring_open(&async_ring, ASYNC_DEPTH)) async_thread = std::thread(&BasicAllocDB::async_loop, this);
+		}
+		if(async_ring.fd < 0){
+			lk.unlock();
+			a.ok = (write ? x_write(fd, buf, a.io.start, a.io.count) : x_read(fd, buf, a.io.start, a.io.count)) >= a.io.count;
+			count_io(write, ns_since(a.start));
+			// Once written, see write_at()
+			if(write){
+				bk.touch();
+				bk.write_done(a.slot);
+			}
+			return false;
+		}
+		// `a` may be completed by the other thread from here on
+		if(async_inflight < ASYNC_DEPTH && x_ring_push(&async_ring, &a.io)){
+			async_inflight++;
+			x_ring_submit(&async_ring);
+		}else async_backlog.push_back(&a);
+		return true;
+	}
+	void async_loop(){
+		x_io_t* done[64];
+		for(bool last = false; !last;){
+			size_t n = x_ring_reap(&async_ring, done, 64, true);
+			// Freed slots are refilled from the backlog before running any callback
+			{
+				std::lock_guard _(async_lock);
+				for(size_t i = 0; i < n; i++) async_inflight -= done[i] != &async_wake;
+				while(!async_backlog.empty() && async_inflight < ASYNC_DEPTH && x_ring_push(&async_ring, &async_backlog.front()->io)){
+					async_backlog.pop_front();
+					async_inflight++;
+				}
+				x_ring_submit(&async_ring);
+				last = async_stopping && !async_inflight && async_backlog.empty();
+			}
+			for(size_t i = 0; i < n; i++){
+				if(done[i] == &async_wake) continue;
+				Async* a = (Async*) done[i];
+				a->ok = a->io.result >= a->io.count;
+				count_io(a->io.write, ns_since(a->start));
+				// Once written, see write_at()
+				if(a->io.write){
+					get_bucket(a->bucket).touch();
+					get_bucket(a->bucket).write_done(a->slot);
+				}
+				a->done(a);
+			}
+		}
+	}
+	// Operations still in flight are waited for
+	void async_stop(){
+		{
+			std::lock_guard _(async_lock);
+			if(!async_thread.joinable()) return;
+			async_stopping = true;
+			// There is always room for it, as operations that are waited for count against ASYNC_DEPTH
+			if(x_ring_push(&async_ring, &async_wake)) x_ring_submit(&async_ring);
+		}
+		async_thread.join();
+		x_ring_close(&async_ring);
+	}
+	public:
+	// Awaitable returned by async_read()/async_write(). co_await gives whether the operation succeeded
+	struct AsyncIO: Async{
+		BasicAllocDB& db;
+		uint64_t ptr;
+		void* buf;
+		bool write;
+		std::coroutine_handle<> h;
+		AsyncIO(BasicAllocDB& db, uint64_t ptr, void* buf, bool write) : db(db), ptr(ptr), buf(buf), write(write){}
+		bool await_ready(){ return false; }
+		bool await_suspend(std::coroutine_handle<> handle){
+			h = handle;
+			this->done = [](Async* a){ static_cast<AsyncIO*>(a)->h.resume(); };
+			return db.async_start(*this, ptr, buf, write);
+		}
+		bool await_resume(){ return this->ok; }
+	};
+	// Awaitable returned by async_flush()
+	struct AsyncFlush{
+		BasicAllocDB& db;
+		std::coroutine_handle<> h;
+		bool await_ready(){ return false; }
+		void await_suspend(std::coroutine_handle<> handle){
+			h = handle;
+			db.on_durable(db.seq(), [](void* p){ ((AsyncFlush*) p)->h.resume(); }, this);
+		}
+		void await_resume(){}
+	};
+	AsyncIO async_read(uint64_t ptr, void* buf){ return {*this, ptr, buf, false}; }
+	AsyncIO async_write(uint64_t ptr, const void* buf){ return {*this, ptr, (void*) buf, true}; }
+	AsyncFlush async_flush(){ return {*this}; }
+	// Callback versions: cb(arg, ok) is called on the completion thread, or immediately on the calling thread if the operation was done synchronously
+	void async_read(uint64_t ptr, void* buf, void (*cb)(void*, bool), void* arg){ async_call(ptr, buf, false, cb, arg); }
+	void async_write(uint64_t ptr, const void* buf, void (*cb)(void*, bool), void* arg){ async_call(ptr, (void*) buf, true, cb, arg); }
+	void async_flush(void (*cb)(void*), void* arg){ on_durable(seq(), cb, arg); }
+	private:
+	struct AsyncCall: Async{
+		void (*cb)(void*, bool);
+		void* arg;
+	};
+	void async_call(uint64_t ptr, void* buf, bool write, void (*cb)(void*, bool), void* arg){
+		AsyncCall* c = new AsyncCall();
+		c->cb = cb;
+		c->arg = arg;
+		c->done = [](Async* a){
+			AsyncCall* c = static_cast<AsyncCall*>(a);
+			c->cb(c->arg, c->ok);
+			delete c;
+		};
+		if(!async_start(*c, ptr, buf, write)) c->done(c);
+	}
+};
+
+class AllocDB: public BasicAllocDB<>{
+	public: using BasicAllocDB::BasicAllocDB;
+};
+// allocdb.hpp declares Stats with these sizes
+static_assert(sizeof(AllocDB::Stats::buckets) / sizeof(AllocDB::BucketStats) == 160 && sizeof(AllocDB::Stats::read_latency) / sizeof(uint64_t) == 32);
\ No newline at end of file
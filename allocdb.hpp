@@ -1,10 +1,32 @@
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <coroutine>
 
+// AllocDB with the default size class geometry, BasicAllocDB<DefaultGeometry>. Other geometries (see BucketGeometry in allocdb.cpp) have the same API
 class AllocDB{
 	public:
+	struct Options{
+		// Memory budget in bytes of the built-in block cache, which keeps frequently read blocks in memory using a scan-resistant (ARC) eviction policy. 0 disables it
+		uint64_t cache_size = 0;
+		// Have write()s of cached blocks only update the cache. Blocks are then written to disk when evicted, or by flush(). Writes to buckets that have handed out a view() go straight to disk, so that the view sees them. A block whose write back keeps failing when the AllocDB is destroyed is lost, see Stats::writeback_errors
+		bool write_back = false;
+		// Bypass the OS page cache (O_DIRECT) for buckets whose block size is a multiple of 4096 bytes. Unaligned buffers and partial reads/writes are handled with internal bounce buffers, at the cost of a copy
+		bool direct_io = false;
+		// Keep a CRC32C of every block in a side file per bucket, computed by writes and verified by reads (including partial ones, which then read the whole block). A read whose data doesn't match fails with errno set to EBADMSG. Blocks handed out by view_mut() lose their checksum until their next write()
+		bool checksums = false;
+		// Compress blocks of buckets whose block size is at least this many bytes, with a fast built-in LZ4-style codec. Only the compressed data is written and the rest of the block is punched (see punch_holes()), so disk space and I/O shrink with the compression ratio. Blocks that don't compress by at least 1/8th are stored as is. size_of() is unchanged, but partial reads/writes of compressed blocks read/write the whole block, and view()/view_mut() fail for them. Compressed buckets are always checksummed, so that a block whose data and compressed length a crash left out of step fails to read with EBADMSG rather than decompressing to garbage. 0 disables it
+		uint64_t compress_min = 0;
+		// Threads that load the free lists in the background after opening. Free lists are kept in the frees file, which is mapped rather than read, so opening takes about the same time however many free blocks there are. With 0, each bucket's free list is loaded by the first operation that needs it
+		int load_threads = 0;
+	};
 	// Construct an AllocDB from path pointing to folder. The folder will be created if it does not exist.
 	AllocDB(std::string folder);
+	// Same as above, with non-default options
+	AllocDB(std::string folder, const Options& opts);
+	// Same as above, with bucket files spread over several folders, ideally on different devices, so that throughput adds up. Each bucket (size class) lives in one folder, taken round robin, and the files of each folder are synced by a thread of their own on flush. Metadata lives in the first folder. Pointers don't depend on the folders: existing bucket files are found in any of them, so folders can be added or reordered between runs as long as the first one stays first
+	AllocDB(std::vector<std::string> folders);
+	AllocDB(std::vector<std::string> folders, const Options& opts);
 	// Destruct and flush an AllocDB
 	~AllocDB();
 	// Calculate the size of a block pointed to by ptr. This would be equal to the size allocated by alloc(). The block does not have to be currently allocated for the size to be calculatable. If ptr is obviously invalid, 0 is returned.
@@ -12,17 +34,153 @@ class AllocDB{
 	// Flush all internal state to disk. This is automatically called when the AllocDB is destroyed, but can be called manually to ensure data is on disk at a specific point in time. This function is atomic with respect to other write and flush operations, except when it is called by the destructor. You should not destroy the database until all other operations have returned.
 	void flush();
 
+	struct CacheStats{
+		uint64_t hits, misses, size;
+	};
+	// Hit/miss counters and current size in bytes of the built-in block cache
+	CacheStats cache_stats();
+
+	// Number of buckets of the default geometry, and of latency histogram bins. allocdb.cpp checks that they match its own
+	static constexpr int MAX_BUCKETS = 160, LATENCY_BINS = 32;
+	struct BucketStats{
+		// Size of blocks in this bucket
+		uint64_t block_size;
+		// Operations since the db was opened
+		uint64_t allocs, frees, reads, writes, bytes_read, bytes_written;
+		// live_blocks: allocated blocks. free_blocks: freed blocks waiting to be reused, including ones cached by threads
+		uint64_t live_blocks, free_blocks;
+		// file_size: size of the file on disk, including preallocated space. used_bytes: space taken by live and free blocks
+		uint64_t file_size, used_bytes;
+		// Number of times and total time the bucket's lock had to be waited for
+		uint64_t lock_waits, lock_wait_ns;
+	};
+	struct Stats{
+		BucketStats buckets[MAX_BUCKETS];
+		uint64_t master_lock_waits, master_lock_wait_ns;
+		// Total and longest flush duration
+		uint64_t flushes, checkpoints, flush_ns, flush_max_ns;
+		// Latency histograms of bucket file I/O. Bin i counts operations that took [2^i, 2^(i+1)) ns
+		uint64_t read_latency[LATENCY_BINS], write_latency[LATENCY_BINS];
+		// Reads that failed checksum verification
+		uint64_t checksum_errors;
+		// free()s of blocks or small objects that were already free. They are caught before they can corrupt the free list, and ignored
+		uint64_t double_frees;
+		// Write backs of dirty cached blocks that failed (see Options::write_back). The blocks stay dirty in the cache and are retried by the next flush() or eviction. When closing, a block whose write back fails twice is reported on stderr and its data is lost
+		uint64_t writeback_errors;
+	};
+	// Get runtime statistics: per-bucket operation counts, space usage and lock contention, flush times and I/O latency. Counters are spread over a few cache line aligned shards, which threads are assigned to round-robin, and only summed here, so keeping them costs little. They are read without stopping other threads, so they are not an exact point in time snapshot
+	Stats stats();
+
+	// Get the current commit sequence number. Every alloc(), free(), write() and root change that completed before this call is made durable once the sequence number is durable. Sequence numbers are shared by all threads and only increase
+	uint64_t seq();
+	// Block until sequence number `s` (from seq()) is durable. Durability is provided by a background thread, started on first use, which flushes on behalf of all waiting callers at once (group commit)
+	void wait_durable(uint64_t s);
+	// Like wait_durable(), but instead of blocking, cb(arg) is called once sequence number `s` is durable. cb is called on the background thread, or immediately on the calling thread if `s` is already durable. Callbacks run one after another and hold up the next flush, so they should be short. They may call flush() and on_durable(), but must not call wait_durable() or destroy the db, which would have the background thread wait for itself (this aborts)
+	void on_durable(uint64_t s, void (*cb)(void*), void* arg);
+
 	// Get the root pointer. The root pointer is a 64-bit value that is not interpreted by AllocDB, but is guaranteed to be persistent across restarts of the database. It can be used by the user to point to some important structure in the database, such as an index or tree root node. Default value is -1
 	uint64_t root();
 	// Set the root pointer. See the other overload, `root()`.
 	void root(uint64_t r);
 
+	// A group of writes, allocs, frees and a root change that become durable together with a single sync, such that after a crash either all or none of them are seen
+	// Writes are staged in the batch (their data is copied), and only reach the blocks on commit(). Allocs are made immediately, but are freed again if the batch is destroyed without being committed. If the process crashes before commit(), they are leaked, like any allocated block nothing points to yet. Committing does not need flush() for durability. Batches committed concurrently are applied concurrently, so if they write the same bytes, which one wins is unspecified
+	class WriteBatch{
+		public:
+		WriteBatch(AllocDB& db);
+		// Frees the blocks allocated by the batch if it was not committed
+		~WriteBatch();
+		// Allocate a block as by AllocDB::alloc(), owned by the batch until it is committed
+		uint64_t alloc(uint64_t& size);
+		// Stage freeing a block as by AllocDB::free()
+		void free(uint64_t ptr);
+		// Stage a write of a whole block, or a range of it. Returns false if the range does not fit within size_of(ptr)
+		bool write(uint64_t ptr, const void* buf);
+		bool write_at(uint64_t ptr, uint64_t off, uint64_t len, const void* buf);
+		// Stage setting the root pointer
+		void root(uint64_t r);
+		// Durably log the batch, then apply it. Once this returns true, the batch is empty and can be reused. On false (the log write failed), nothing was applied and the batch is left as it was
+		bool commit();
+	};
+
 	// Allocate a block of at least `size` bytes. The actual size allocated is written back to `size`. Returns an ID pointing to the allocated block, or -1 on failure.
+	// Sizes of up to 512 bytes are rounded up to one of 16, 32, 48, 64, 96, 128, 192, 256, 384 or 512 bytes and packed into 1024 byte slabs (see slab_of()), instead of taking a whole 1024 byte block each
 	uint64_t alloc(uint64_t& size);
-	// Free a block previously allocated with alloc(). If ptr is obviously invalid, the function does nothing.
+	// Allocate `n` blocks of at least `size` bytes each that are adjacent on disk, for sequential layout. The block size is written back to `size` (small sizes are not packed into slabs). Returns the ID of the first block, the others follow at `size` byte steps (ID + i * size), or -1 on failure. Each block is then freed on its own with free()
+	// Free space is tracked per bucket in address order, so the lowest run of `n` free blocks is used, or else the end of the file
+	uint64_t alloc_contiguous(uint64_t& size, uint64_t n);
+	// Resize the block pointed to by ptr to at least `size` bytes, keeping its contents up to the smaller of the old and new sizes. The actual size is written back to `size` as by alloc(). If the new size falls in the same size class, ptr itself is returned and nothing moves. Otherwise the data is copied to a newly allocated block inside the kernel (copy_file_range(), which filesystems with reflinks turn into shared extents), ptr is freed, and the new ID is returned. Buckets with checksums or compression, and ranges that are unaligned for direct I/O, are copied through memory instead. Returns -1 on failure, in which case ptr is left as it was
+	uint64_t realloc(uint64_t ptr, uint64_t& size);
+	// Get the block (slab) holding the object pointed to by ptr, and the object's offset within it. Reading a slab with read() gets all the small objects packed into it in one I/O. For blocks that aren't small objects, ptr itself and an offset of 0 are returned
+	static uint64_t slab_of(uint64_t ptr, uint64_t& off);
+	// Free a block previously allocated with alloc(). If ptr is obviously invalid, the function does nothing. Freeing a block that is already free is detected and does nothing either (see Stats::double_frees)
 	void free(uint64_t ptr);
 	// Read the entire contents of the block pointed to by ptr into buf. The size of the block is determined by size_of(ptr), which is equal to the size allocated by alloc(). Returns true on success, false on failure (for example, if ptr is obviously invalid, or if the underlying read operation fails)
 	bool read(uint64_t ptr, void* buf);
 	// Write the entire contents of buf to the block pointed to by ptr. The size of the block is determined by size_of(ptr), which is equal to the size allocated by alloc(). Returns true on success, false on failure (for example, if ptr is obviously invalid, or if the underlying write operation fails)
 	bool write(uint64_t ptr, const void* buf);
+	// Read `len` bytes starting `off` bytes into the block pointed to by ptr into buf. Returns false if the range does not fit within size_of(ptr), or on any failure read() would return false for
+	bool read_at(uint64_t ptr, uint64_t off, uint64_t len, void* buf);
+	// Write `len` bytes from buf starting `off` bytes into the block pointed to by ptr. The rest of the block is left untouched. Returns false if the range does not fit within size_of(ptr), or on any failure write() would return false for
+	bool write_at(uint64_t ptr, uint64_t off, uint64_t len, const void* buf);
+
+	// Called by compact() after a live block has been copied from `from` to `to`. Return false to veto the move, in which case `from` stays where it is
+	typedef bool (*relocate_fn)(void* arg, uint64_t from, uint64_t to);
+	// Run one slice of online compaction, which shrinks bucket files by trimming free blocks off their end and moving live blocks from their end into free slots nearer the front. At most `budget` blocks are moved or trimmed per call, so that foreground operations keep running. Every move is reported to cb(arg, from, to), after which `from` is no longer valid and `to` must be used instead. A write racing with the move of its block either lands before the block is copied, or fails as the block is then past the end. Reads may fail the same way. Files written through view_mut() only have free blocks trimmed, as writes through a view can't be held off. Files that have handed out a view() keep their size, and their trimmed end is only punched (see punch_holes()), so views stay valid. 1024 byte blocks are only trimmed and never moved, as they may be slabs holding small objects. Returns true if the budget was used up, i.e there may be more to do
+	bool compact(relocate_fn cb, void* arg, size_t budget = 64);
+
+	// Release the disk space of freed blocks of at least `min_size` bytes by punching holes in the underlying files. Reallocating such a block costs nothing extra, its contents just read as zeros until written. free() punches the hole itself, unless `deferred` is true, in which case it is left to reclaim(). Disabled by default
+	void punch_holes(uint64_t min_size, bool deferred = false);
+	// Punch holes in up to `budget` free blocks that are at least as big as the punch_holes() threshold and have not been punched yet, such as ones freed in deferred mode or before the threshold was set. Meant to be called periodically from a background thread. Returns true if the budget was used up, i.e there may be more to do
+	bool reclaim(size_t budget = 64);
+
+	// A span of memory directly mapped to a block. See view()
+	template<typename T>
+	struct View{
+		T* data = 0;
+		uint64_t size = 0;
+		T* begin() const{ return data; }
+		T* end() const{ return data + size; }
+		explicit operator bool() const{ return data; }
+	};
+	// Get a read-only view of the block pointed to by ptr, backed by a shared mapping of the underlying file, so that reading it involves no syscall or copy. The view has size size_of(ptr) and stays valid until the AllocDB is destroyed, even after the block is freed (at which point its contents are unspecified). On failure (for example, if ptr is obviously invalid, or the block lies past the end of the file), an empty view is returned and read() should be used instead
+	View<const char> view(uint64_t ptr);
+	// Same as view(), but the view is writable and writes to it update the block in place. These writes are made durable by flush() like any other
+	View<char> view_mut(uint64_t ptr);
+
+	// One entry of a read_many()/write_many() batch. `ok` is set to whether that entry succeeded
+	struct IO{
+		uint64_t ptr;
+		void* buf;
+		bool ok;
+	};
+	// Read many blocks at once, each as if by read(ios[i].ptr, ios[i].buf). The whole batch is submitted to the kernel at once where supported (io_uring), and completes before the function returns. Returns the number of entries that succeeded
+	size_t read_many(IO* ios, size_t n);
+	// Write many blocks at once, each as if by write(ios[i].ptr, ios[i].buf). See read_many(). Returns the number of entries that succeeded
+	size_t write_many(IO* ios, size_t n);
+
+	// Awaitable returned by async_read()/async_write(). co_await gives whether the operation succeeded
+	struct AsyncIO{
+		bool await_ready();
+		bool await_suspend(std::coroutine_handle<> h);
+		bool await_resume();
+	};
+	// Awaitable returned by async_flush()
+	struct AsyncFlush{
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> h);
+		void await_resume();
+	};
+	// Read the whole block pointed to by ptr into buf, as by read(), without blocking. The read is queued on an io_uring ring owned by the db, set up on first use, and the coroutine is resumed on the db's completion thread once it is done. Operations that find the ring full are held in a queue rather than blocking, so thousands can be in flight from a few threads. buf must stay valid until then
+	// As for read_many(), the block cache is bypassed. Buckets with checksums or compression, unaligned buffers for direct I/O, and platforms without io_uring are done synchronously, in which case the coroutine doesn't suspend
+	AsyncIO async_read(uint64_t ptr, void* buf);
+	// Write the whole block pointed to by ptr from buf, as by write(), without blocking. See async_read()
+	AsyncIO async_write(uint64_t ptr, const void* buf);
+	// Callback versions of the above: cb(arg, ok) is called on the completion thread, or immediately on the calling thread if the operation was done synchronously
+	void async_read(uint64_t ptr, void* buf, void (*cb)(void*, bool), void* arg);
+	void async_write(uint64_t ptr, const void* buf, void (*cb)(void*, bool), void* arg);
+	// Resume once everything that completed before the call is durable, as by wait_durable(seq()). The coroutine is resumed on the group commit thread
+	AsyncFlush async_flush();
+	// Callback version of the above, see on_durable()
+	void async_flush(void (*cb)(void*), void* arg);
 };
@@ -0,0 +1,195 @@
+#include "allocdb.cpp"
+#include <vector>
+#include <chrono>
+#include <random>
+
+// Benchmark driver for AllocDB. Sweeps workloads, block sizes and thread counts, printing one JSON document to stdout
+// bench [folder] [--threads N] [--ops N] [--blocks N] [--min-size B] [--max-size B] [--workloads churn,read,write,mixed,load] [--cache B] [--direct] [--checksums]
+
+// Latency histogram in the style of HdrHistogram: values (in ns) are grouped by power of two, each power split into SUB linear sub-buckets, so any recorded value is off by at most 1/SUB
+struct Histogram{
+	static constexpr int SUB_BITS = 5, SUB = 1 << SUB_BITS;
+	uint64_t counts[64 * SUB] = {}, total = 0, max = 0;
+	// Values of [2^k, 2^(k+1)) for k >= SUB_BITS are shifted right by mag = k - SUB_BITS into [SUB, 2*SUB), so bucket (mag+1)*SUB + sub covers [(SUB+sub) << mag, (SUB+sub+1) << mag)
+	static constexpr int index_of(uint64_t v){
+		if(v < SUB) return v;
+		int mag = 63 - std::countl_zero(v) - SUB_BITS;
+		return (mag + 1) * SUB + (v >> mag) - SUB;
+	}
+	// Highest value that maps to bucket i
+	static constexpr uint64_t value_of(int i){
+		if(i < SUB) return i;
+		int mag = i / SUB - 1;
+		return ((uint64_t(i % SUB + SUB) + 1) << mag) - 1;
+	}
+	// Every value lands in the bucket that value_of() bounds it by, buckets are in order and no wider than 1/SUB of their values
+	static constexpr bool check(uint64_t v){
+		int i = index_of(v);
+		return i < 64 * SUB && v <= value_of(i) && (!i || value_of(i-1) < v) && value_of(i) - v <= v / SUB;
+	}
+	static constexpr bool check_all(){
+		for(uint64_t v = 0; v < 1 << 12; v++) if(!check(v)) return false;
+		for(int k = 12; k < 64; k++) for(uint64_t v : {uint64_t(1) << k, (uint64_t(1) << k) - 1, (uint64_t(1) << k) + 1, (uint64_t(3) << (k-1)) - 1}) if(!check(v)) return false;
+		return check(uint64_t(-1));
+	}
+	void record(uint64_t v){ counts[index_of(v)]++; total++; if(v > max) max = v; }
+	void merge(const Histogram& h){
+		for(int i = 0; i < 64 * SUB; i++) counts[i] += h.counts[i];
+		total += h.total; if(h.max > max) max = h.max;
+	}
+	uint64_t percentile(double p) const{
+		uint64_t want = uint64_t(p / 100 * total + 0.5), seen = 0;
+		if(!want) want = 1;
+		for(int i = 0; i < 64 * SUB; i++) if((seen += counts[i]) >= want) return std::min(value_of(i), max);
+		return max;
+	}
+};
+static_assert(Histogram::check_all());
+
+using Clock = std::chrono::steady_clock;
+// The database folder holds only plain files
+static void remove_folder(const std::string& folder){
+	folder_list_t dir = x_opendir(folder.c_str());
+	if(dir){
+		while(char* name = x_next(dir)) if(name[0] != '.') x_remove((folder + "/" + name).c_str());
+		x_closedir(dir);
+	}
+	x_remove(folder.c_str());
+}
+
+static uint64_t ns_since(Clock::time_point t){ return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t).count(); }
+
+struct Config{
+	std::string folder = "bench.db";
+	int threads = 0;
+	uint64_t ops = 20000, blocks = 4096, min_size = 1024, max_size = 1 << 20;
+	std::vector<std::string> workloads = {"churn", "read", "write", "mixed", "load"};
+	AllocDB::Options opts;
+};
+
+// One run of `workload` with `threads` threads. Every thread owns an equal share of `live` and only touches those blocks
+// churn: alloc() immediately followed by free(). read/write: whole blocks at random. mixed: 80% reads, 20% writes. load: alloc() and write() new blocks, at most LOAD_BYTES per thread, freed afterwards
+static constexpr uint64_t LOAD_BYTES = 256 << 20;
+static double run(AllocDB& db, const std::string& workload, uint64_t size, int threads, uint64_t ops, std::vector<uint64_t>& live, Histogram& hist){
+	std::vector<Histogram*> hists(threads);
+	// Per thread, so that cleanup after load isn't timed
+	std::vector<uint64_t> elapsed(threads);
+	std::vector<std::thread> ts;
+	auto start = Clock::now();
+	for(int t = 0; t < threads; t++) ts.emplace_back([&, t]{
+		Histogram* h = hists[t] = new Histogram();
+		std::mt19937_64 rng(t * 7919 + size);
+		std::vector<char> buf(size, char(t));
+		size_t lo = live.size() * t / threads, n = live.size() * (t+1) / threads - lo;
+		uint64_t* mine = live.data() + lo;
+		std::vector<uint64_t> loaded;
+		uint64_t count = workload == "load" ? std::min(ops, std::max<uint64_t>(1, LOAD_BYTES / size)) : ops;
+		for(uint64_t i = 0; i < count; i++){
+			auto t0 = Clock::now();
+			if(workload == "churn"){
+				uint64_t sz = size, p = db.alloc(sz);
+				db.free(p);
+			}else if(workload == "load"){
+				uint64_t sz = size, p = db.alloc(sz);
+				if(!db.write(p, buf.data())){
+					fprintf(stderr, "write(): failure\n");
+					abort();
+				}
+				loaded.push_back(p);
+			}else if(!n){
+				break;
+			}else{
+				uint64_t p = mine[rng() % n];
+				bool write = workload == "write" || (workload == "mixed" && rng() % 5 == 0);
+				if(!(write ? db.write(p, buf.data()) : db.read(p, buf.data()))){
+					fprintf(stderr, "%s(): failure\n", write ? "write" : "read");
+					abort();
+				}
+			}
+			h->record(ns_since(t0));
+		}
+		elapsed[t] = ns_since(start);
+		for(uint64_t p : loaded) db.free(p);
+	});
+	for(auto& t : ts) t.join();
+	for(Histogram* h : hists){ hist.merge(*h); delete h; }
+	return *std::max_element(elapsed.begin(), elapsed.end()) / 1e9;
+}
+
+static void print_histogram(const Histogram& h){
+	printf("{\"count\": %llu, \"max_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"buckets\": [",
+		(unsigned long long) h.total, (unsigned long long) h.max, (unsigned long long) h.percentile(50), (unsigned long long) h.percentile(99), (unsigned long long) h.percentile(99.9));
+	bool first = true;
+	for(int i = 0; i < 64 * Histogram::SUB; i++) if(h.counts[i]){
+		printf("%s[%llu, %llu]", first ? "" : ", ", (unsigned long long) Histogram::value_of(i), (unsigned long long) h.counts[i]);
+		first = false;
+	}
+	printf("]}");
+}
+
+int main(int argc, char** argv){
+	Config cfg;
+	for(int i = 1; i < argc; i++){
+		std::string a = argv[i];
+		auto next = [&]{
+			if(i+1 >= argc){ fprintf(stderr, "missing value for %s\n", a.c_str()); exit(1); }
+			return std::string(argv[++i]);
+		};
+		if(a == "--threads") cfg.threads = std::stoi(next());
+		else if(a == "--ops") cfg.ops = std::stoull(next());
+		else if(a == "--blocks") cfg.blocks = std::stoull(next());
+		else if(a == "--min-size") cfg.min_size = std::stoull(next());
+		else if(a == "--max-size") cfg.max_size = std::stoull(next());
+		else if(a == "--cache") cfg.opts.cache_size = std::stoull(next());
+		else if(a == "--direct") cfg.opts.direct_io = true;
+		else if(a == "--checksums") cfg.opts.checksums = true;
+		else if(a == "--workloads"){
+			cfg.workloads.clear();
+			std::string s = next();
+			for(size_t p = 0, q; p <= s.size(); p = q + 1){
+				q = s.find(',', p); if(q == std::string::npos) q = s.size();
+				if(q > p) cfg.workloads.push_back(s.substr(p, q - p));
+			}
+		}else if(a[0] != '-') cfg.folder = a;
+		else{ fprintf(stderr, "unknown option %s\n", a.c_str()); return 1; }
+	}
+	if(cfg.threads <= 0) cfg.threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<int> thread_counts;
+	for(int t = 1; t < cfg.threads; t *= 2) thread_counts.push_back(t);
+	thread_counts.push_back(cfg.threads);
+
+	printf("{\"ops_per_thread\": %llu, \"blocks\": %llu, \"cache_size\": %llu, \"direct_io\": %s, \"checksums\": %s, \"results\": [\n",
+		(unsigned long long) cfg.ops, (unsigned long long) cfg.blocks, (unsigned long long) cfg.opts.cache_size, cfg.opts.direct_io ? "true" : "false", cfg.opts.checksums ? "true" : "false");
+	bool first = true;
+	// One size per power of two of the bucket geometry, i.e every 4th bucket. size_of() of a bare bucket number is that bucket's block size
+	for(uint64_t bucket = 0, size; (size = AllocDB::size_of(bucket)); bucket += 4){
+		if(size < cfg.min_size) continue;
+		if(size > cfg.max_size) break;
+		remove_folder(cfg.folder);
+		AllocDB db(cfg.folder, cfg.opts);
+		// Working set for read/write/mixed
+		std::vector<uint64_t> live(cfg.blocks);
+		std::vector<char> buf(size);
+		for(uint64_t& p : live){
+			uint64_t sz = size;
+			if((p = db.alloc(sz)) == uint64_t(-1) || !db.write(p, buf.data())){
+				fprintf(stderr, "alloc(): failure\n");
+				return 1;
+			}
+		}
+		db.flush();
+		for(const std::string& w : cfg.workloads) for(int threads : thread_counts){
+			Histogram hist;
+			double secs = run(db, w, size, threads, cfg.ops, live, hist);
+			printf("%s{\"workload\": \"%s\", \"size\": %llu, \"threads\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"latency\": ",
+				first ? "" : ",\n", w.c_str(), (unsigned long long) size, threads, secs, hist.total / secs);
+			print_histogram(hist);
+			printf("}");
+			fflush(stdout);
+			first = false;
+		}
+	}
+	printf("\n]}\n");
+	remove_folder(cfg.folder);
+	return 0;
+}
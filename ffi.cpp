@@ -1,17 +1,136 @@
 #include "allocdb.cpp"
+// Structs, as ffi.h declares them
+struct AllocDBBlob: BasicAllocDB<BlobGeometry>{
+	using BasicAllocDB::BasicAllocDB;
+};
+struct AllocDBRecord: BasicAllocDB<RecordGeometry>{
+	using BasicAllocDB::BasicAllocDB;
+};
 extern "C"{
 #include "ffi.h"
+}
+
+template<typename DB = AllocDB>
+static typename DB::Options to_options(const allocdb_options* opts){
+	typename DB::Options o;
+	o.cache_size = opts->cache_size;
+	o.write_back = opts->write_back;
+	o.direct_io = opts->direct_io;
+	o.checksums = opts->checksums;
+	o.compress_min = opts->compress_min;
+	o.load_threads = opts->load_threads;
+	return o;
+}
+template<typename DB>
+static void to_stats(DB* db, allocdb_stats* out){
+	auto st = db->stats();
+	static_assert(sizeof(st.buckets[0]) == sizeof(out->buckets[0]) && sizeof(st.buckets) <= sizeof(out->buckets) && sizeof(st.read_latency) == sizeof(out->read_latency));
+	memset(out, 0, sizeof(*out));
+	memcpy(out->buckets, st.buckets, sizeof(st.buckets));
+	out->master_lock_waits = st.master_lock_waits;
+	out->master_lock_wait_ns = st.master_lock_wait_ns;
+	out->flushes = st.flushes;
+	out->checkpoints = st.checkpoints;
+	out->flush_ns = st.flush_ns;
+	out->flush_max_ns = st.flush_max_ns;
+	memcpy(out->read_latency, st.read_latency, sizeof(out->read_latency));
+	memcpy(out->write_latency, st.write_latency, sizeof(out->write_latency));
+	out->checksum_errors = st.checksum_errors;
+	out->double_frees = st.double_frees;
+	out->writeback_errors = st.writeback_errors;
+}
+
+extern "C"{
 
 AllocDB* allocdb_create(const char* folder){ return new AllocDB(folder); }
+AllocDB* allocdb_create_ex(const char* folder, const allocdb_options* opts){ return new AllocDB(folder, to_options(opts)); }
+AllocDB* allocdb_create_multi(const char* const* folders, size_t n, const allocdb_options* opts){ return n ? new AllocDB(std::vector<std::string>(folders, folders + n), to_options(opts)) : nullptr; }
 void allocdb_destroy(AllocDB* db){ delete db; }
 inline uint64_t allocdb_size_of(uint64_t ptr){ return AllocDB::size_of(ptr); }
+inline uint64_t allocdb_slab_of(uint64_t ptr, uint64_t* off){ return AllocDB::slab_of(ptr, *off); }
 void allocdb_flush(AllocDB* db){ db->flush(); }
+uint64_t allocdb_seq(AllocDB* db){ return db->seq(); }
+void allocdb_wait_durable(AllocDB* db, uint64_t s){ db->wait_durable(s); }
+void allocdb_on_durable(AllocDB* db, uint64_t s, void (*cb)(void*), void* arg){ db->on_durable(s, cb, arg); }
 
 uint64_t allocdb_alloc(AllocDB* db, uint64_t* size){ return db->alloc(*size); }
+uint64_t allocdb_alloc_contiguous(AllocDB* db, uint64_t* size, uint64_t n){ return db->alloc_contiguous(*size, n); }
+uint64_t allocdb_realloc(AllocDB* db, uint64_t ptr, uint64_t* size){ return db->realloc(ptr, *size); }
 void allocdb_free(AllocDB* db, uint64_t ptr){ db->free(ptr); }
 bool allocdb_write(AllocDB* db, uint64_t ptr, const void* buf){ return db->write(ptr, buf); }
 bool allocdb_read(AllocDB* db, uint64_t ptr, void* buf){ return db->read(ptr, buf); }
+bool allocdb_write_at(AllocDB* db, uint64_t ptr, uint64_t off, uint64_t len, const void* buf){ return db->write_at(ptr, off, len, buf); }
+bool allocdb_read_at(AllocDB* db, uint64_t ptr, uint64_t off, uint64_t len, void* buf){ return db->read_at(ptr, off, len, buf); }
+const void* allocdb_view(AllocDB* db, uint64_t ptr){ return db->view(ptr).data; }
+void* allocdb_view_mut(AllocDB* db, uint64_t ptr){ return db->view_mut(ptr).data; }
+bool allocdb_compact(AllocDB* db, bool (*cb)(void* arg, uint64_t from, uint64_t to), void* arg, size_t budget){ return db->compact(cb, arg, budget); }
+void allocdb_punch_holes(AllocDB* db, uint64_t min_size, bool deferred){ db->punch_holes(min_size, deferred); }
+bool allocdb_reclaim(AllocDB* db, size_t budget){ return db->reclaim(budget); }
+static_assert(sizeof(allocdb_io) == sizeof(AllocDB::IO));
+size_t allocdb_read_many(AllocDB* db, allocdb_io* ios, size_t n){ return db->read_many((AllocDB::IO*) ios, n); }
+size_t allocdb_write_many(AllocDB* db, allocdb_io* ios, size_t n){ return db->write_many((AllocDB::IO*) ios, n); }
+void allocdb_async_read(AllocDB* db, uint64_t ptr, void* buf, void (*cb)(void*, bool), void* arg){ db->async_read(ptr, buf, cb, arg); }
+void allocdb_async_write(AllocDB* db, uint64_t ptr, const void* buf, void (*cb)(void*, bool), void* arg){ db->async_write(ptr, buf, cb, arg); }
+void allocdb_async_flush(AllocDB* db, void (*cb)(void*), void* arg){ db->async_flush(cb, arg); }
+allocdb_cache_stats allocdb_get_cache_stats(AllocDB* db){
+	auto st = db->cache_stats();
+	return {st.hits, st.misses, st.size};
+}
+void allocdb_get_stats(AllocDB* db, allocdb_stats* out){ to_stats(db, out); }
 inline uint64_t get_root(AllocDB* db){ return db->root(); }
 inline void set_root(AllocDB* db, uint64_t r){ db->root(r); }
+allocdb_batch* allocdb_batch_create(AllocDB* db){ return (allocdb_batch*) new AllocDB::WriteBatch(*db); }
+uint64_t allocdb_batch_alloc(allocdb_batch* b, uint64_t* size){ return ((AllocDB::WriteBatch*) b)->alloc(*size); }
+void allocdb_batch_free(allocdb_batch* b, uint64_t ptr){ ((AllocDB::WriteBatch*) b)->free(ptr); }
+bool allocdb_batch_write(allocdb_batch* b, uint64_t ptr, const void* buf){ return ((AllocDB::WriteBatch*) b)->write(ptr, buf); }
+bool allocdb_batch_write_at(allocdb_batch* b, uint64_t ptr, uint64_t off, uint64_t len, const void* buf){ return ((AllocDB::WriteBatch*) b)->write_at(ptr, off, len, buf); }
+void allocdb_batch_root(allocdb_batch* b, uint64_t r){ ((AllocDB::WriteBatch*) b)->root(r); }
+bool allocdb_batch_commit(allocdb_batch* b){ return ((AllocDB::WriteBatch*) b)->commit(); }
+void allocdb_batch_destroy(allocdb_batch* b){ delete (AllocDB::WriteBatch*) b; }
+
+#define ALLOCDB_VARIANT(T, p) \
+T* p##_create(const char* folder){ return new T(folder); } \
+T* p##_create_ex(const char* folder, const allocdb_options* opts){ return new T(folder, to_options<T>(opts)); } \
+T* p##_create_multi(const char* const* folders, size_t n, const allocdb_options* opts){ return n ? new T(std::vector<std::string>(folders, folders + n), to_options<T>(opts)) : nullptr; } \
+void p##_destroy(T* db){ delete db; } \
+void p##_flush(T* db){ db->flush(); } \
+uint64_t p##_seq(T* db){ return db->seq(); } \
+void p##_wait_durable(T* db, uint64_t s){ db->wait_durable(s); } \
+void p##_on_durable(T* db, uint64_t s, void (*cb)(void*), void* arg){ db->on_durable(s, cb, arg); } \
+uint64_t p##_size_of(uint64_t ptr){ return T::size_of(ptr); } \
+uint64_t p##_alloc(T* db, uint64_t* size){ return db->alloc(*size); } \
+uint64_t p##_alloc_contiguous(T* db, uint64_t* size, uint64_t n){ return db->alloc_contiguous(*size, n); } \
+uint64_t p##_realloc(T* db, uint64_t ptr, uint64_t* size){ return db->realloc(ptr, *size); } \
+uint64_t p##_slab_of(uint64_t ptr, uint64_t* off){ return T::slab_of(ptr, *off); } \
+void p##_free(T* db, uint64_t ptr){ db->free(ptr); } \
+bool p##_read(T* db, uint64_t ptr, void* buf){ return db->read(ptr, buf); } \
+bool p##_write(T* db, uint64_t ptr, const void* buf){ return db->write(ptr, buf); } \
+bool p##_read_at(T* db, uint64_t ptr, uint64_t off, uint64_t len, void* buf){ return db->read_at(ptr, off, len, buf); } \
+bool p##_write_at(T* db, uint64_t ptr, uint64_t off, uint64_t len, const void* buf){ return db->write_at(ptr, off, len, buf); } \
+const void* p##_view(T* db, uint64_t ptr){ return db->view(ptr).data; } \
+void* p##_view_mut(T* db, uint64_t ptr){ return db->view_mut(ptr).data; } \
+bool p##_compact(T* db, bool (*cb)(void* arg, uint64_t from, uint64_t to), void* arg, size_t budget){ return db->compact(cb, arg, budget); } \
+void p##_punch_holes(T* db, uint64_t min_size, bool deferred){ db->punch_holes(min_size, deferred); } \
+bool p##_reclaim(T* db, size_t budget){ return db->reclaim(budget); } \
+size_t p##_read_many(T* db, allocdb_io* ios, size_t n){ return db->read_many((T::IO*) ios, n); } \
+size_t p##_write_many(T* db, allocdb_io* ios, size_t n){ return db->write_many((T::IO*) ios, n); } \
+void p##_async_read(T* db, uint64_t ptr, void* buf, void (*cb)(void*, bool), void* arg){ db->async_read(ptr, buf, cb, arg); } \
+void p##_async_write(T* db, uint64_t ptr, const void* buf, void (*cb)(void*, bool), void* arg){ db->async_write(ptr, buf, cb, arg); } \
+void p##_async_flush(T* db, void (*cb)(void*), void* arg){ db->async_flush(cb, arg); } \
+allocdb_cache_stats p##_get_cache_stats(T* db){ auto st = db->cache_stats(); return {st.hits, st.misses, st.size}; } \
+void p##_get_stats(T* db, allocdb_stats* out){ to_stats(db, out); } \
+uint64_t p##_get_root(T* db){ return db->root(); } \
+void p##_set_root(T* db, uint64_t r){ db->root(r); } \
+p##_batch* p##_batch_create(T* db){ return (p##_batch*) new T::WriteBatch(*db); } \
+uint64_t p##_batch_alloc(p##_batch* b, uint64_t* size){ return ((T::WriteBatch*) b)->alloc(*size); } \
+void p##_batch_free(p##_batch* b, uint64_t ptr){ ((T::WriteBatch*) b)->free(ptr); } \
+bool p##_batch_write(p##_batch* b, uint64_t ptr, const void* buf){ return ((T::WriteBatch*) b)->write(ptr, buf); } \
+bool p##_batch_write_at(p##_batch* b, uint64_t ptr, uint64_t off, uint64_t len, const void* buf){ return ((T::WriteBatch*) b)->write_at(ptr, off, len, buf); } \
+void p##_batch_root(p##_batch* b, uint64_t r){ ((T::WriteBatch*) b)->root(r); } \
+bool p##_batch_commit(p##_batch* b){ return ((T::WriteBatch*) b)->commit(); } \
+void p##_batch_destroy(p##_batch* b){ delete (T::WriteBatch*) b; }
+ALLOCDB_VARIANT(AllocDBBlob, allocdb_blob)
+ALLOCDB_VARIANT(AllocDBRecord, allocdb_record)
+#undef ALLOCDB_VARIANT
 
 }
\ No newline at end of file
@@ -2,24 +2,195 @@ struct AllocDB;
 
 // Init an AllocDB from path pointing to folder. The folder will be created if it does not exist.
 AllocDB* allocdb_create(const char* folder);
+typedef struct{
+	// Memory budget in bytes of the built-in block cache, which keeps frequently read blocks in memory using a scan-resistant (ARC) eviction policy. 0 disables it
+	uint64_t cache_size;
+	// Have writes of cached blocks only update the cache. Blocks are then written to disk when evicted, or by allocdb_flush(). Writes to buckets that have handed out an allocdb_view() go straight to disk, so that the view sees them. A block whose write back keeps failing when the AllocDB is closed is lost, see allocdb_stats.writeback_errors
+	bool write_back;
+	// Bypass the OS page cache (O_DIRECT) for buckets whose block size is a multiple of 4096 bytes. Unaligned buffers and partial reads/writes are handled with internal bounce buffers, at the cost of a copy
+	bool direct_io;
+	// Keep a CRC32C of every block in a side file per bucket, computed by writes and verified by reads (including partial ones, which then read the whole block). A read whose data doesn't match fails with errno set to EBADMSG. Blocks handed out by allocdb_view_mut() lose their checksum until their next write
+	bool checksums;
+	// Compress blocks of buckets whose block size is at least this many bytes, with a fast built-in LZ4-style codec. Only the compressed data is written and the rest of the block is punched (see allocdb_punch_holes()), so disk space and I/O shrink with the compression ratio. Blocks that don't compress by at least 1/8th are stored as is. allocdb_size_of() is unchanged, but partial reads/writes of compressed blocks read/write the whole block, and allocdb_view()/allocdb_view_mut() fail for them. Compressed buckets are always checksummed, so that a block whose data and compressed length a crash left out of step fails to read with EBADMSG rather than decompressing to garbage. 0 disables it
+	uint64_t compress_min;
+	// Threads that load the free lists in the background after opening. Free lists are kept in the frees file, which is mapped rather than read, so opening takes about the same time however many free blocks there are. With 0, each bucket's free list is loaded by the first operation that needs it
+	int load_threads;
+} allocdb_options;
+// Same as allocdb_create(), with non-default options. Zero-initialized options are the defaults
+AllocDB* allocdb_create_ex(const char* folder, const allocdb_options* opts);
+// Same as allocdb_create_ex(), with bucket files spread over n folders, ideally on different devices, so that throughput adds up. Each bucket (size class) lives in one folder, taken round robin, and the files of each folder are synced by a thread of their own on flush. Metadata lives in folders[0]. Pointers don't depend on the folders: existing bucket files are found in any of them, so folders can be added or reordered between runs as long as folders[0] stays first. Returns NULL if n is 0
+AllocDB* allocdb_create_multi(const char* const* folders, size_t n, const allocdb_options* opts);
 // Teardown and flush an AllocDB
 void allocdb_destroy(AllocDB* db);
 // Flush all internal state to disk. This is automatically called when the AllocDB is destroyed, but can be called manually to ensure data is on disk at a specific point in time. This function is atomic with respect to other write and flush operations, except when it is called from the teardown function. You should not teardown the database until all other operations have returned.
 void allocdb_flush(AllocDB* db);
+// Get the current commit sequence number. Every allocdb_alloc(), allocdb_free(), allocdb_write() and root change that completed before this call is made durable once the sequence number is durable. Sequence numbers are shared by all threads and only increase
+uint64_t allocdb_seq(AllocDB* db);
+// Block until sequence number `s` (from allocdb_seq()) is durable. Durability is provided by a background thread, started on first use, which flushes on behalf of all waiting callers at once (group commit)
+void allocdb_wait_durable(AllocDB* db, uint64_t s);
+// Like allocdb_wait_durable(), but instead of blocking, cb(arg) is called once sequence number `s` is durable. cb is called on the background thread, or immediately on the calling thread if `s` is already durable. Callbacks run one after another and hold up the next flush, so they should be short. They may call allocdb_flush() and allocdb_on_durable(), but must not call allocdb_wait_durable() or allocdb_destroy(), which would have the background thread wait for itself (this aborts)
+void allocdb_on_durable(AllocDB* db, uint64_t s, void (*cb)(void*), void* arg);
 // Calculate the size of a block pointed to by ptr. This would be equal to the size allocated by allocdb_alloc(). The block does not have to be currently allocated for the size to be calculatable. If ptr is obviously invalid, 0 is returned.
 inline uint64_t allocdb_size_of(uint64_t ptr);
 
 // Allocate a block of at least `*size` bytes. The actual size allocated is written back to `*size`. Returns an ID pointing to the allocated block, or -1 on failure.
+// Sizes of up to 512 bytes are rounded up to one of 16, 32, 48, 64, 96, 128, 192, 256, 384 or 512 bytes and packed into 1024 byte slabs (see allocdb_slab_of()), instead of taking a whole 1024 byte block each
 uint64_t allocdb_alloc(AllocDB* db, uint64_t* size);
-// Free a block previously allocated with allocdb_alloc(). If ptr is obviously invalid, the function does nothing.
+// Allocate `n` blocks of at least `*size` bytes each that are adjacent on disk, for sequential layout. The block size is written back to `*size` (small sizes are not packed into slabs). Returns the ID of the first block, the others follow at `*size` byte steps (ID + i * *size), or -1 on failure. Each block is then freed on its own with allocdb_free()
+// Free space is tracked per bucket in address order, so the lowest run of `n` free blocks is used, or else the end of the file
+uint64_t allocdb_alloc_contiguous(AllocDB* db, uint64_t* size, uint64_t n);
+// Resize the block pointed to by ptr to at least `*size` bytes, keeping its contents up to the smaller of the old and new sizes. The actual size is written back to `*size` as by allocdb_alloc(). If the new size falls in the same size class, ptr itself is returned and nothing moves. Otherwise the data is copied to a newly allocated block inside the kernel (copy_file_range(), which filesystems with reflinks turn into shared extents), ptr is freed, and the new ID is returned. Buckets with checksums or compression, and ranges that are unaligned for direct I/O, are copied through memory instead. Returns -1 on failure, in which case ptr is left as it was
+uint64_t allocdb_realloc(AllocDB* db, uint64_t ptr, uint64_t* size);
+// Get the block (slab) holding the object pointed to by ptr, and write the object's offset within it to `*off`. Reading a slab with allocdb_read() gets all the small objects packed into it in one I/O. For blocks that aren't small objects, ptr itself and an offset of 0 are returned
+inline uint64_t allocdb_slab_of(uint64_t ptr, uint64_t* off);
+// Free a block previously allocated with allocdb_alloc(). If ptr is obviously invalid, the function does nothing. Freeing a block that is already free is detected and does nothing either (see allocdb_stats.double_frees)
 void allocdb_free(AllocDB* db, uint64_t ptr);
 // Read the entire contents of the block pointed to by ptr into buf. The size of the block is determined by allocdb_size_of(ptr), which is equal to the size allocated by allocdb_alloc(). Returns true on success, false on failure (for example, if ptr is obviously invalid, or if the underlying read operation fails)
 bool allocdb_read(AllocDB* db, uint64_t ptr, void* buf);
 // Write the entire contents of buf to the block pointed to by ptr. The size of the block is determined by allocdb_size_of(ptr), which is equal to the size allocated by allocdb_alloc(). Returns true on success, false on failure (for example, if ptr is obviously invalid, or if the underlying write operation fails)
 bool allocdb_write(AllocDB* db, uint64_t ptr, const void* buf);
+// Read `len` bytes starting `off` bytes into the block pointed to by ptr into buf. Returns false if the range does not fit within allocdb_size_of(ptr), or on any failure allocdb_read() would return false for
+bool allocdb_read_at(AllocDB* db, uint64_t ptr, uint64_t off, uint64_t len, void* buf);
+// Write `len` bytes from buf starting `off` bytes into the block pointed to by ptr. The rest of the block is left untouched. Returns false if the range does not fit within allocdb_size_of(ptr), or on any failure allocdb_write() would return false for
+bool allocdb_write_at(AllocDB* db, uint64_t ptr, uint64_t off, uint64_t len, const void* buf);
+
+// Get a pointer to the block pointed to by ptr, backed by a shared mapping of the underlying file, so that reading it involves no syscall or copy. The memory is allocdb_size_of(ptr) bytes long and stays valid until the AllocDB is torn down, even after the block is freed (at which point its contents are unspecified). On failure (for example, if ptr is obviously invalid, or the block lies past the end of the file), 0 (NULL) is returned and allocdb_read() should be used instead
+const void* allocdb_view(AllocDB* db, uint64_t ptr);
+// Same as allocdb_view(), but the memory is writable and writes to it update the block in place. These writes are made durable by allocdb_flush() like any other
+void* allocdb_view_mut(AllocDB* db, uint64_t ptr);
+
+// Run one slice of online compaction, which shrinks bucket files by trimming free blocks off their end and moving live blocks from their end into free slots nearer the front. At most `budget` blocks are moved or trimmed per call, so that foreground operations keep running. Every move is reported to cb(arg, from, to), after which `from` is no longer valid and `to` must be used instead. cb may return false to veto the move. A write racing with the move of its block either lands before the block is copied, or fails as the block is then past the end. Reads may fail the same way. Files written through allocdb_view_mut() only have free blocks trimmed, as writes through a view can't be held off. Files that have handed out an allocdb_view() keep their size, and their trimmed end is only punched, so views stay valid. 1024 byte blocks are only trimmed and never moved, as they may be slabs holding small objects. Returns true if the budget was used up, i.e there may be more to do
+bool allocdb_compact(AllocDB* db, bool (*cb)(void* arg, uint64_t from, uint64_t to), void* arg, size_t budget);
+
+// Release the disk space of freed blocks of at least `min_size` bytes by punching holes in the underlying files. Reallocating such a block costs nothing extra, its contents just read as zeros until written. allocdb_free() punches the hole itself, unless `deferred` is true, in which case it is left to allocdb_reclaim(). Disabled by default
+void allocdb_punch_holes(AllocDB* db, uint64_t min_size, bool deferred);
+// Punch holes in up to `budget` free blocks that are at least as big as the allocdb_punch_holes() threshold and have not been punched yet, such as ones freed in deferred mode or before the threshold was set. Meant to be called periodically from a background thread. Returns true if the budget was used up, i.e there may be more to do
+bool allocdb_reclaim(AllocDB* db, size_t budget);
+
+// One entry of an allocdb_read_many()/allocdb_write_many() batch. `ok` is set to whether that entry succeeded
+typedef struct{
+	uint64_t ptr;
+	void* buf;
+	bool ok;
+} allocdb_io;
+// Read many blocks at once, each as if by allocdb_read(db, ios[i].ptr, ios[i].buf). The whole batch is submitted to the kernel at once where supported (io_uring), and completes before the function returns. Returns the number of entries that succeeded
+size_t allocdb_read_many(AllocDB* db, allocdb_io* ios, size_t n);
+// Write many blocks at once, each as if by allocdb_write(db, ios[i].ptr, ios[i].buf). See allocdb_read_many(). Returns the number of entries that succeeded
+size_t allocdb_write_many(AllocDB* db, allocdb_io* ios, size_t n);
+// Read the whole block pointed to by ptr into buf, as by allocdb_read(), without blocking. The read is queued on an io_uring ring owned by the db, set up on first use, and cb(arg, ok) is called on the db's completion thread once it is done. Operations that find the ring full are held in a queue rather than blocking, so thousands can be in flight from a few threads. buf must stay valid until cb is called
+// As for allocdb_read_many(), the block cache is bypassed. Buckets with checksums or compression, unaligned buffers for direct I/O, and platforms without io_uring are done synchronously, in which case cb is called on the calling thread before returning
+void allocdb_async_read(AllocDB* db, uint64_t ptr, void* buf, void (*cb)(void* arg, bool ok), void* arg);
+// Write the whole block pointed to by ptr from buf, as by allocdb_write(), without blocking. See allocdb_async_read()
+void allocdb_async_write(AllocDB* db, uint64_t ptr, const void* buf, void (*cb)(void* arg, bool ok), void* arg);
+// Call cb(arg) once everything that completed before the call is durable, as by allocdb_on_durable(db, allocdb_seq(db), cb, arg)
+void allocdb_async_flush(AllocDB* db, void (*cb)(void*), void* arg);
+
+typedef struct{
+	uint64_t hits, misses, size;
+} allocdb_cache_stats;
+// Hit/miss counters and current size in bytes of the built-in block cache
+allocdb_cache_stats allocdb_get_cache_stats(AllocDB* db);
+
+typedef struct{
+	// Size of blocks in this bucket
+	uint64_t block_size;
+	// Operations since the db was opened
+	uint64_t allocs, frees, reads, writes, bytes_read, bytes_written;
+	// live_blocks: allocated blocks. free_blocks: freed blocks waiting to be reused, including ones cached by threads
+	uint64_t live_blocks, free_blocks;
+	// file_size: size of the file on disk, including preallocated space. used_bytes: space taken by live and free blocks
+	uint64_t file_size, used_bytes;
+	// Number of times and total time the bucket's lock had to be waited for
+	uint64_t lock_waits, lock_wait_ns;
+} allocdb_bucket_stats;
+typedef struct{
+	// Indexed by bucket # (the low 8 bits of block IDs). Entries past the last bucket are all zero
+	allocdb_bucket_stats buckets[256];
+	uint64_t master_lock_waits, master_lock_wait_ns;
+	// Total and longest flush duration
+	uint64_t flushes, checkpoints, flush_ns, flush_max_ns;
+	// Latency histograms of bucket file I/O. Bin i counts operations that took [2^i, 2^(i+1)) ns
+	uint64_t read_latency[32], write_latency[32];
+	// Reads that failed checksum verification
+	uint64_t checksum_errors;
+	// allocdb_free()s of blocks or small objects that were already free. They are caught before they can corrupt the free list, and ignored
+	uint64_t double_frees;
+	// Write backs of dirty cached blocks that failed (see allocdb_options.write_back). The blocks stay dirty in the cache and are retried by the next allocdb_flush() or eviction. When closing, a block whose write back fails twice is reported on stderr and its data is lost
+	uint64_t writeback_errors;
+} allocdb_stats;
+// Get runtime statistics into `out`: per-bucket operation counts, space usage and lock contention, flush times and I/O latency. They are read without stopping other threads, so they are not an exact point in time snapshot
+void allocdb_get_stats(AllocDB* db, allocdb_stats* out);
 
 // Get the root pointer. The root pointer is a 64-bit value that is not interpreted by AllocDB, but is guaranteed to be persistent across restarts of the database. It can be used by the user to point to some important structure in the database, such as an index or tree root node. Default value is -1
 inline uint64_t get_root(AllocDB* db);
 
 // Set the root pointer. See `get_root()`.
-inline void set_root(AllocDB* db, uint64_t r);
\ No newline at end of file
+inline void set_root(AllocDB* db, uint64_t r);
+
+// A group of writes, allocs, frees and a root change that become durable together with a single sync, such that after a crash either all or none of them are seen
+// Writes are staged in the batch (their data is copied), and only reach the blocks on allocdb_batch_commit(). Allocs are made immediately, but are freed again if the batch is destroyed without being committed. If the process crashes before allocdb_batch_commit(), they are leaked, like any allocated block nothing points to yet. Committing does not need allocdb_flush() for durability. Batches committed concurrently are applied concurrently, so if they write the same bytes, which one wins is unspecified
+typedef struct allocdb_batch allocdb_batch;
+allocdb_batch* allocdb_batch_create(AllocDB* db);
+// Allocate a block as by allocdb_alloc(), owned by the batch until it is committed
+uint64_t allocdb_batch_alloc(allocdb_batch* b, uint64_t* size);
+// Stage freeing a block as by allocdb_free()
+void allocdb_batch_free(allocdb_batch* b, uint64_t ptr);
+// Stage a write of a whole block as by allocdb_write(), or a range of it as by allocdb_write_at(). Returns false if the range does not fit within allocdb_size_of(ptr)
+bool allocdb_batch_write(allocdb_batch* b, uint64_t ptr, const void* buf);
+bool allocdb_batch_write_at(allocdb_batch* b, uint64_t ptr, uint64_t off, uint64_t len, const void* buf);
+// Stage setting the root pointer
+void allocdb_batch_root(allocdb_batch* b, uint64_t r);
+// Durably log the batch, then apply it. Once this returns true, the batch is empty and can be reused. On false (the log write failed), nothing was applied and the batch is left as it was
+bool allocdb_batch_commit(allocdb_batch* b);
+// Destroy a batch, freeing the blocks it allocated if it was not committed
+void allocdb_batch_destroy(allocdb_batch* b);
+
+// Prebuilt variants with other size class geometries. Each has its own handle type and the whole API above under its own prefix, with the same semantics, e.g allocdb_blob_alloc(AllocDBBlob* db, uint64_t* size). Databases are not portable across variants
+// AllocDBBlob, allocdb_blob_*: 2 size classes per doubling from 4096 bytes and no small object tier, for blob storage
+// AllocDBRecord, allocdb_record_*: 8 size classes per doubling from 2048 bytes, for records. At most 12.5% internal fragmentation instead of 25%
+#define ALLOCDB_VARIANT(T, p) \
+struct T; \
+T* p##_create(const char* folder); \
+T* p##_create_ex(const char* folder, const allocdb_options* opts); \
+T* p##_create_multi(const char* const* folders, size_t n, const allocdb_options* opts); \
+void p##_destroy(T* db); \
+void p##_flush(T* db); \
+uint64_t p##_seq(T* db); \
+void p##_wait_durable(T* db, uint64_t s); \
+void p##_on_durable(T* db, uint64_t s, void (*cb)(void*), void* arg); \
+uint64_t p##_size_of(uint64_t ptr); \
+uint64_t p##_alloc(T* db, uint64_t* size); \
+uint64_t p##_alloc_contiguous(T* db, uint64_t* size, uint64_t n); \
+uint64_t p##_realloc(T* db, uint64_t ptr, uint64_t* size); \
+uint64_t p##_slab_of(uint64_t ptr, uint64_t* off); \
+void p##_free(T* db, uint64_t ptr); \
+bool p##_read(T* db, uint64_t ptr, void* buf); \
+bool p##_write(T* db, uint64_t ptr, const void* buf); \
+bool p##_read_at(T* db, uint64_t ptr, uint64_t off, uint64_t len, void* buf); \
+bool p##_write_at(T* db, uint64_t ptr, uint64_t off, uint64_t len, const void* buf); \
+const void* p##_view(T* db, uint64_t ptr); \
+void* p##_view_mut(T* db, uint64_t ptr); \
+bool p##_compact(T* db, bool (*cb)(void* arg, uint64_t from, uint64_t to), void* arg, size_t budget); \
+void p##_punch_holes(T* db, uint64_t min_size, bool deferred); \
+bool p##_reclaim(T* db, size_t budget); \
+size_t p##_read_many(T* db, allocdb_io* ios, size_t n); \
+size_t p##_write_many(T* db, allocdb_io* ios, size_t n); \
+void p##_async_read(T* db, uint64_t ptr, void* buf, void (*cb)(void* arg, bool ok), void* arg); \
+void p##_async_write(T* db, uint64_t ptr, const void* buf, void (*cb)(void* arg, bool ok), void* arg); \
+void p##_async_flush(T* db, void (*cb)(void*), void* arg); \
+allocdb_cache_stats p##_get_cache_stats(T* db); \
+void p##_get_stats(T* db, allocdb_stats* out); \
+uint64_t p##_get_root(T* db); \
+void p##_set_root(T* db, uint64_t r); \
+typedef struct p##_batch p##_batch; \
+p##_batch* p##_batch_create(T* db); \
+uint64_t p##_batch_alloc(p##_batch* b, uint64_t* size); \
+void p##_batch_free(p##_batch* b, uint64_t ptr); \
+bool p##_batch_write(p##_batch* b, uint64_t ptr, const void* buf); \
+bool p##_batch_write_at(p##_batch* b, uint64_t ptr, uint64_t off, uint64_t len, const void* buf); \
+void p##_batch_root(p##_batch* b, uint64_t r); \
+bool p##_batch_commit(p##_batch* b); \
+void p##_batch_destroy(p##_batch* b);
+ALLOCDB_VARIANT(AllocDBBlob, allocdb_blob)
+ALLOCDB_VARIANT(AllocDBRecord, allocdb_record)
+#undef ALLOCDB_VARIANT
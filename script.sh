@@ -3,6 +3,9 @@
 # Fuzz testing
 # clang++ -O3 -std=c++20 test.cpp -fsanitize=fuzzer,undefined -o .test && ./.test
 
+# Benchmarks, results are printed as JSON (see bench.cpp for options)
+# clang++ -O3 -std=c++20 bench.cpp -o .bench && ./.bench > bench.json
+
 OPTIONAL_FLAGS="-flto -fno-exceptions"
 
 # build C lib
@@ -13,6 +16,9 @@ clang++ -c -fPIC -O3 $OPTIONAL_FLAGS ffi.cpp -o .o
 clang++ -c -fPIC -O3 $OPTIONAL_FLAGS allocdb.cpp -o .o
 	&& ar rcs liballocdb.a .o && rm .o
 
+# build the benchmark driver, run as ./allocdb-bench [folder] [options] > bench.json
+clang++ -O3 -std=c++20 $OPTIONAL_FLAGS bench.cpp -o allocdb-bench
+
 
 # MSVC
 # clang-cl /O2 /c /EHs- /EHc- ffi.cpp /Fo.o && lib /OUT:liballocdb.lib .o && del .o
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "allocdb.cpp"
 #include <vector>
+#include <set>
+#include <random>
 
 // Rudimentary, and frankly quite garbage fuzz tester for AllocDB
 // Just to assert basic functionality works as intended
@@ -26,14 +28,263 @@ void test_read(size_t idx){
 		puts("read(): failure");
 		abort();
 	}
-	db.free(ptrs[idx]);
+	int mid;
+	if(!db.read_at(ptr, sz>>3<<2, 4, &mid) || mid != int(sz>>3)){
+		puts("read_at(): failure");
+		abort();
+	}
+	db.free(ptr);
 	for(size_t i = sz>>2; i > 0;){
 		i--;
-		if(a[i] != i){
+		if(a[i] != int(i)){
 			puts("data corrupted");
 			abort();
 		}
 	}
+	free(a);
+}
+
+// Deterministic checks, run once before fuzzing
+static void check(bool ok, const char* what){
+	if(ok) return;
+	printf("%s: failure\n", what);
+	abort();
+}
+static void remove_folder(const std::string& folder){
+	folder_list_t dir = x_opendir(folder.c_str());
+	if(dir){
+		while(char* name = x_next(dir)) if(name[0] != '.') x_remove((folder + "/" + name).c_str());
+		x_closedir(dir);
+	}
+	x_remove(folder.c_str());
+}
+// Free lists (BitTree) hand out the lowest free blocks first once the magazines are drained, and find runs of them for alloc_contiguous()
+void test_free_lists(){
+	remove_folder("example_lists");
+	AllocDB db("example_lists");
+	std::vector<uint64_t> ids;
+	for(int i = 0; i < 1000; i++){ uint64_t sz = 4096; ids.push_back(db.alloc(sz)); }
+	for(int i = 0; i < 1000; i++) if(i % 3) db.free(ids[i]);
+	db.flush();
+	std::set<uint64_t> freed;
+	for(int i = 0; i < 1000; i++) if(i % 3) freed.insert(ids[i]);
+	for(int i = 0; i < 100; i++){
+		uint64_t sz = 4096, p = db.alloc(sz);
+		check(p == *freed.begin(), "alloc() reuses the lowest freed block");
+		freed.erase(p);
+	}
+	// Blocks 3k+1 and 3k+2 are free in pairs, so a run of 2 fits in one and a run of 3 only at the end
+	uint64_t sz = 4096, run = db.alloc_contiguous(sz, 2);
+	check(run != uint64_t(-1) && freed.count(run) && freed.count(run + sz), "alloc_contiguous() of free blocks");
+	uint64_t end = db.alloc_contiguous(sz, 3);
+	check(end != uint64_t(-1) && end > ids.back(), "alloc_contiguous() past the end");
+}
+// Double frees are caught (AtomicBits) and ignored, across blocks far apart
+void test_double_free(){
+	remove_folder("example_df");
+	AllocDB db("example_df");
+	std::vector<uint64_t> ids;
+	for(int i = 0; i < 5000; i++){ uint64_t sz = 1024; ids.push_back(db.alloc(sz)); }
+	for(uint64_t p : ids) db.free(p);
+	check(db.stats().double_frees == 0, "free()");
+	for(int i = 0; i < 5000; i += 97) db.free(ids[i]);
+	check(db.stats().double_frees == (5000 + 96) / 97, "free() twice");
+	std::set<uint64_t> got;
+	for(int i = 0; i < 5000; i++){ uint64_t sz = 1024; got.insert(db.alloc(sz)); }
+	check(got.size() == 5000, "no block handed out twice after double frees");
+}
+// Random allocs and frees across reopens, so that free lists go through checkpoints (bitmaps) and the journal, and load lazily: no ID is ever handed out twice
+void test_checkpoints(){
+	remove_folder("example_ckpt");
+	std::mt19937_64 rng(1);
+	std::set<uint64_t> live;
+	for(int round = 0; round < 20; round++){
+		AllocDB db("example_ckpt");
+		for(int i = 0; i < 3000; i++){
+			if(live.size() && rng() % 2){
+				auto it = live.lower_bound(rng());
+				if(it == live.end()) it = live.begin();
+				db.free(*it);
+				live.erase(it);
+			}else{
+				uint64_t sz = 1 + rng() % 20000, p = db.alloc(sz);
+				check(p != uint64_t(-1) && live.insert(p).second, "alloc() after reopen");
+			}
+			if(rng() % 500 == 0) db.flush();
+		}
+		check(db.stats().double_frees == 0, "free() after reopen");
+	}
+}
+// The block codec round trips, on data that compresses well, badly and in between, and rejects truncated input
+void test_codec(){
+	std::mt19937_64 rng(2);
+	std::vector<char> src(1 << 17), z(src.size()), out(src.size());
+	for(int round = 0; round < 200; round++){
+		size_t n = 1 + rng() % src.size();
+		int alphabet = 1 + rng() % 256;
+		for(size_t i = 0; i < n; i++) src[i] = rng() % 8 ? char(rng() % alphabet) : src[i / 2];
+		size_t zn = lz_compress(src.data(), n, z.data(), n);
+		if(!zn) continue;
+		check(lz_decompress(z.data(), zn, out.data(), n) == n && !memcmp(src.data(), out.data(), n), "lz round trip");
+		check(lz_decompress(z.data(), zn, out.data(), n - 1) == size_t(-1), "lz output bound");
+		if(zn > 1) check(lz_decompress(z.data(), zn - 1, out.data(), n) != n, "lz truncated input");
+	}
+}
+// Committed batches survive a crash: the journal replays their writes, allocs, frees and root
+void test_batch_replay(){
+	remove_folder("example_batch");
+	std::vector<int> a(1024, 1), b(1024, 2), buf(1024);
+	uint64_t p, q, old;
+	{
+		// Never destroyed, as if the process had died, but kept reachable so leak checkers stay quiet
+		static AllocDB* crashed;
+		crashed = new AllocDB("example_batch");
+		uint64_t sz = 4096;
+		old = crashed->alloc(sz);
+		crashed->write(old, a.data());
+		crashed->flush();
+		AllocDB::WriteBatch wb(*crashed);
+		sz = 4096; p = wb.alloc(sz);
+		sz = 4096; q = wb.alloc(sz);
+		check(wb.write(p, a.data()) && wb.write(q, b.data()), "WriteBatch::write()");
+		wb.free(old);
+		wb.root(p);
+		check(wb.commit(), "WriteBatch::commit()");
+	}
+	AllocDB db("example_batch");
+	check(db.root() == p, "batch root replayed");
+	check(db.read(p, buf.data()) && buf == a && db.read(q, buf.data()) && buf == b, "batch writes replayed");
+	std::set<uint64_t> got;
+	for(int i = 0; i < 3; i++){ uint64_t sz = 4096; got.insert(db.alloc(sz)); }
+	check(got.count(old) && !got.count(p) && !got.count(q), "batch allocs and frees replayed");
+}
+// compact() moves live blocks off the end of the file into freed slots, reports each move, and shrinks the file, and the data follows the blocks
+static bool relocate(void* arg, uint64_t from, uint64_t to){
+	for(uint64_t& p : *(std::vector<uint64_t>*) arg) if(p == from) p = to;
+	return true;
+}
+void test_compact(){
+	remove_folder("example_compact");
+	AllocDB db("example_compact");
+	std::vector<uint64_t> ids, live;
+	std::vector<int> buf(1024);
+	for(int i = 0; i < 256; i++){
+		uint64_t sz = 4096;
+		ids.push_back(db.alloc(sz));
+		std::fill(buf.begin(), buf.end(), i);
+		check(db.write(ids[i], buf.data()), "write() before compact()");
+	}
+	for(int i = 0; i < 256; i++){
+		if(i % 4) db.free(ids[i]);
+		else live.push_back(ids[i]);
+	}
+	std::vector<uint64_t> before = live;
+	while(db.compact(relocate, &live, 16));
+	check(live != before, "compact() moves blocks");
+	for(size_t i = 0; i < live.size(); i++){
+		check(db.read(live[i], buf.data()) && buf == std::vector<int>(1024, int(i * 4)), "read() after compact()");
+		check((live[i] & ~uint64_t(0xFF)) < 64 * 4096, "compact() moves blocks to the front");
+	}
+	check(db.stats().buckets[live[0] & 0xFF].file_size <= 64 * 4096, "compact() shrinks the file");
+}
+// The block cache counts a first read as a miss and the next as a hit, and with write_back only writes blocks to their file on flush()
+void test_cache(){
+	remove_folder("example_cache");
+	std::vector<int> a(1024, 1), b(1024, 2), buf(1024);
+	uint64_t p, sz = 4096;
+	{
+		AllocDB db("example_cache");
+		p = db.alloc(sz);
+		check(db.write(p, a.data()), "write() before caching");
+	}
+	AllocDB::Options opts;
+	opts.cache_size = 1 << 20;
+	opts.write_back = true;
+	AllocDB db("example_cache", opts);
+	check(db.read(p, buf.data()) && buf == a, "read() through the cache");
+	check(db.cache_stats().misses == 1 && db.cache_stats().hits == 0, "cache miss");
+	check(db.read(p, buf.data()) && buf == a, "read() from the cache");
+	check(db.cache_stats().hits == 1 && db.cache_stats().size == sz, "cache hit");
+	file_t fd = x_open(("example_cache/" + std::to_string(p & 0xFF)).c_str());
+	check(db.write(p, b.data()) && x_read(fd, buf.data(), p & ~uint64_t(0xFF), sz) == sz && buf == a, "write() only updates the cache");
+	check(db.read(p, buf.data()) && buf == b, "read() of a dirty cached block");
+	db.flush();
+	check(x_read(fd, buf.data(), p & ~uint64_t(0xFF), sz) == sz && buf == b && db.stats().writeback_errors == 0, "flush() writes back");
+	x_close(fd);
+}
+// With direct_io, unaligned partial reads and writes go through bounce buffers and only touch the bytes asked for
+void test_direct(){
+	remove_folder("example_direct");
+	AllocDB::Options opts;
+	opts.direct_io = true;
+	AllocDB db("example_direct", opts);
+	uint64_t sz = 16384, p = db.alloc(sz);
+	std::vector<char> a(sz), buf(sz + 1);
+	for(size_t i = 0; i < sz; i++) a[i] = char(i * 7);
+	check(db.write(p, a.data()), "write() with direct_io");
+	check(db.read_at(p, 4093, 5000, buf.data() + 1) && !memcmp(buf.data() + 1, a.data() + 4093, 5000), "unaligned read_at() with direct_io");
+	memset(a.data() + 10, 'x', 3);
+	check(db.write_at(p, 10, 3, a.data() + 10) && db.read(p, buf.data()) && !memcmp(buf.data(), a.data(), sz), "unaligned write_at() with direct_io");
+}
+// Async writes and reads round trip, whether they go through the ring or are done synchronously
+struct AsyncCount{ std::atomic<int> done = 0, failed = 0; };
+static void async_done(void* arg, bool ok){
+	AsyncCount& c = *(AsyncCount*) arg;
+	if(!ok) c.failed++;
+	c.done++;
+}
+void test_async(){
+	remove_folder("example_async");
+	AllocDB db("example_async");
+	std::vector<uint64_t> ids;
+	std::vector<std::vector<int>> in(64), out(64);
+	AsyncCount writes, reads;
+	for(int i = 0; i < 64; i++){
+		uint64_t sz = 4096 << (i & 3);
+		ids.push_back(db.alloc(sz));
+		in[i].assign(sz / 4, i);
+		out[i].resize(sz / 4);
+		db.async_write(ids[i], in[i].data(), async_done, &writes);
+	}
+	while(writes.done < 64) std::this_thread::yield();
+	check(!writes.failed, "async_write()");
+	for(int i = 0; i < 64; i++) db.async_read(ids[i], out[i].data(), async_done, &reads);
+	while(reads.done < 64) std::this_thread::yield();
+	check(!reads.failed && in == out, "async_read() after async_write()");
+}
+// realloc() keeps the data up to the smaller size when moving between size classes, small objects included, and doesn't move within one
+void test_realloc(){
+	remove_folder("example_realloc");
+	AllocDB db("example_realloc");
+	std::vector<char> a(1 << 20), buf(1 << 20);
+	for(size_t i = 0; i < a.size(); i++) a[i] = char(i * 13 + 1);
+	uint64_t sz = 100, p = db.alloc(sz);
+	check(db.write(p, a.data()), "write() before realloc()");
+	for(uint64_t want : {5000, 300000, 1 << 20, 2000, 50}){
+		uint64_t old = sz;
+		sz = want;
+		uint64_t q = db.realloc(p, sz);
+		check(q != uint64_t(-1) && sz >= want && db.size_of(q) == sz, "realloc()");
+		check(db.read(q, buf.data()) && !memcmp(buf.data(), a.data(), std::min(old, sz)), "realloc() keeps the data");
+		check(db.write(q, a.data()), "write() after realloc()");
+		p = q;
+	}
+	uint64_t same = sz - 1;
+	check(db.realloc(p, same) == p && same == sz, "realloc() within a size class");
+	check(db.stats().double_frees == 0, "realloc() frees the old block once");
+}
+extern "C" int LLVMFuzzerInitialize(int*, char***){
+	test_free_lists();
+	test_double_free();
+	test_checkpoints();
+	test_codec();
+	test_batch_replay();
+	test_compact();
+	test_cache();
+	test_direct();
+	test_async();
+	test_realloc();
+	return 0;
 }
 
 // llvm fuzz test
@@ -29,6 +29,21 @@ typedef DIR* folder_list_t;
 static const file_t X_FILE_T_INVALID = (file_t) -1;
 #endif
 
+#ifdef __linux__
+#include <linux/io_uring.h>
+typedef struct{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* ring;
+	size_t ring_sz, sqes_sz;
+} x_ring_t;
+#else
+typedef struct{ int fd; } x_ring_t;
+#endif
+
 const uint64_t X_FILE_NOT_FOUND = 0, X_FILE_UNKNOWN = 0,
 	X_FILE_TYPE_FILE = 1,
 	X_FILE_TYPE_FOLDER = 2,
@@ -55,9 +70,16 @@ static inline void x_closedir(folder_list_t dir);
 // Open a file from a null-terminated string specifying the pathname
 static inline file_t x_open(const char* name);
 
+// Same as x_open(), but reads and writes bypass the OS page cache. Offsets, sizes and buffer addresses passed to x_read()/x_write() on the file must be multiples of X_DIRECT_ALIGN. Returns X_FILE_T_INVALID if the platform or filesystem does not support it
+static inline file_t x_open_direct(const char* name);
+static const size_t X_DIRECT_ALIGN = 4096;
+
 // Move a file atomically
 static inline bool x_move(const char* old_name, const char* new_name);
 
+// Make changes to a folder's entries (files created, moved or deleted in it) durable, like x_datasync() does for a file's data
+static inline bool x_syncdir(const char* name);
+
 
 // Get the size of a file in bytes
 static inline uint64_t x_getsize(file_t fd);
@@ -71,6 +93,18 @@ static inline size_t x_write(file_t fd, const void* buf, uint64_t start, size_t
 // Set the size of a file in bytes. If the size is smaller than the current size, the file is truncated, otherwise it is expanded and the additional bytes are all set to 0
 static inline bool x_setsize(file_t fd, uint64_t sz);
 
+// Reserve disk space for the byte range [start, start+count) of a file, expanding it if needed like x_setsize(). Where the platform cannot reserve space, this just expands the file
+static inline bool x_allocate(file_t fd, uint64_t start, uint64_t count);
+
+// Release the disk space backing the byte range [start, start+count) of a file, which then reads as zeros. The file size is unchanged. Returns false if the platform or filesystem does not support it
+static inline bool x_punch(file_t fd, uint64_t start, uint64_t count);
+
+// Copy `count` bytes from [from_start, from_start+count) of one file to [to_start, to_start+count) of another, or of the same one if the ranges don't overlap. Where the platform allows it (copy_file_range() on Linux), the data never passes through user memory, and filesystems that support it share the extents instead (reflink). Otherwise, or across filesystems, it is read and written through a page aligned buffer, so ranges that are aligned for direct I/O stay valid. Returns the number of bytes copied
+static inline size_t x_copy(file_t from, uint64_t from_start, file_t to, uint64_t to_start, size_t count);
+
+// Flush a file's data (and whatever metadata is needed to read it back, such as its size) to disk
+static inline bool x_datasync(file_t fd);
+
 // Close a file. The file_t becomes invalid before the function returns and new calls to x_open may create file_t handles that compare == to this one. It is best practice to completely forget the old file handle and never assume anything about it after it has been closed, much like you would with a pointer that has been free()'d
 static inline void x_close(file_t fd);
 
@@ -81,6 +115,32 @@ static inline void x_close(file_t fd);
 // On failure, 0 (NULL) is returned
 static inline void* x_mapfile(file_t fd, uint64_t off, size_t sz, bool copy);
 
+// A single positional read or write, see x_batch()
+typedef struct{
+	file_t fd;
+	// Only read from for writes
+	void* buf;
+	uint64_t start;
+	size_t count;
+	// Set by x_batch() to the number of bytes actually transferred, or 0 if the operation failed
+	size_t result;
+	bool write;
+} x_io_t;
+
+// Set up a submission ring able to hold `entries` operations at a time (io_uring on Linux). A ring must not be used by more than one thread at a time. Returns false if the platform does not support it (on Linux, kernels older than 5.6), in which case the ring is still valid to pass to x_batch() and x_ring_close()
+static inline bool x_ring_open(x_ring_t* r, unsigned entries);
+// Tear down a ring set up by x_ring_open()
+static inline void x_ring_close(x_ring_t* r);
+// Perform `n` reads/writes, submitting as many at once as the ring allows and waiting for all of them to complete. `r` may be 0 (NULL) or a ring that failed to open, in which case the operations are performed one by one with x_read()/x_write(). Operations whose fd is X_FILE_T_INVALID are skipped and get a result of 0
+static inline void x_batch(x_ring_t* r, x_io_t* ios, size_t n);
+// Queue one operation on a ring without waiting for it, to be sent to the kernel by x_ring_submit() and collected by x_ring_reap(). `io` must stay valid until then. An operation whose fd is X_FILE_T_INVALID does nothing and completes with a result of 0, which can be used to wake up x_ring_reap(). Returns false if the ring is full or not usable, or if the operation is bigger than X_RING_MAX, in which case nothing was queued
+static inline bool x_ring_push(x_ring_t* r, x_io_t* io);
+// Send the operations queued by x_ring_push() to the kernel. Returns false if the ring broke
+static inline bool x_ring_submit(x_ring_t* r);
+// Collect up to `max` completed operations queued by x_ring_push(), setting their result. With `wait`, blocks until at least one has completed. Returns the number of operations written to `done`
+// Pushing/submitting and reaping may be done by two different threads at the same time, but neither by more than one
+static inline size_t x_ring_reap(x_ring_t* r, x_io_t** done, size_t max, bool wait);
+
 // Allocate `sz` pages (`sz * X_PAGE_SIZE` bytes) of memory, with all bytes initially set to 0
 static inline void* x_pagealloc(size_t sz);
 
@@ -90,9 +150,15 @@ static inline void x_pagefree(void* ptr, size_t sz);
 // Check if a file exists and get metadata
 static inline x_stat_t x_stat(const char* name);
 
+// CRC32C (Castagnoli) of `count` bytes, continuing from `crc` (0 to start a new checksum). Uses the SSE4.2 CRC32 and PCLMULQDQ instructions on x86 and the ARMv8 CRC32 instructions on ARM when the CPU has them, and a table-driven loop otherwise
+static inline uint32_t x_crc32c(uint32_t crc, const void* buf, size_t count);
+
 // Page size used by X (always 65536). Specifically, x_mapfile()/x_pagealloc()/x_pagefree() have all their size/offset arguments measured in pages of 65536 bytes. Converting from pages to bytes or vice versa is as simple a shifting right (>>) or left (<<) 16 bits
 static const size_t X_PAGE_SIZE = 65536;
 
+// Largest operation x_ring_push() takes, as Linux transfers at most this much in one read/write
+static const size_t X_RING_MAX = 0x7FFFF000;
+
 
 #ifdef _WIN32
 #include <malloc.h>
@@ -104,6 +170,12 @@ static inline file_t x_open(const char* name){
 	NULL);
 }
 
+static inline file_t x_open_direct(const char* name){
+	return (file_t) CreateFileA(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_POSIX_SEMANTICS | FILE_FLAG_RANDOM_ACCESS | FILE_FLAG_NO_BUFFERING,
+	NULL);
+}
+
 static inline uint64_t x_getsize(file_t fd){
 	LARGE_INTEGER li;
 	if (!GetFileSizeEx(fd, &li)) return 0;
@@ -167,7 +239,18 @@ static inline bool x_setsize(file_t fd, uint64_t sz){
 	return SetFileInformationByHandle(fd, FileEndOfFileInfo, &eof, sizeof(eof));
 }
 
+static inline bool x_allocate(file_t fd, uint64_t start, uint64_t count){
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = start + count;
+	SetFileInformationByHandle(fd, FileAllocationInfo, &info, sizeof(info));
+	return x_getsize(fd) >= start + count || x_setsize(fd, start + count);
+}
+
+// Would need the file to be marked sparse first
+static inline bool x_punch(file_t fd, uint64_t start, uint64_t count){ return false; }
+
 static inline bool x_flush(file_t fd){ return FlushFileBuffers(fd); }
+static inline bool x_datasync(file_t fd){ return FlushFileBuffers(fd); }
 
 static inline void x_close(file_t fd){ CloseHandle(fd); }
 
@@ -249,6 +332,9 @@ static inline bool x_move(const char* old_name, const char* new_name){
 	return ReplaceFileA(new_name, old_name, 0, 0, 0, 0);
 }
 
+// Folder handles can't be flushed without admin rights. NTFS commits renames through its metadata log
+static inline bool x_syncdir(const char* name){ return true; }
+
 #else
 #define _FILE_OFFSET_BITS 64
 #include <sys/mman.h>
@@ -261,24 +347,72 @@ static inline file_t x_open(const char* name){
 	return (file_t) open(name, O_RDWR | O_CREAT, 0666);
 }
 
+static inline file_t x_open_direct(const char* name){
+#if defined(O_DIRECT)
+	return (file_t) open(name, O_RDWR | O_CREAT | O_DIRECT, 0666);
+#elif defined(F_NOCACHE)
+	int fd = open(name, O_RDWR | O_CREAT, 0666);
+	if(fd >= 0 && fcntl(fd, F_NOCACHE, 1)){ close(fd); return X_FILE_T_INVALID; }
+	return (file_t) fd;
+#else
+	return X_FILE_T_INVALID;
+#endif
+}
+
 static inline uint64_t x_getsize(file_t fd){
 	struct stat st;
 	return fstat(fd, &st) ? 0 : st.st_size;
 }
 
+// A single pread()/pwrite() may transfer less than asked for (Linux stops at X_RING_MAX bytes), so big counts take several
 static inline size_t x_read(file_t fd, void* buf, uint64_t start, size_t count){
-	return pread(fd, buf, count, start);
+	size_t done = 0;
+	while(done < count){
+		ssize_t r = pread(fd, (char*) buf + done, count - done, start + done);
+		if(r <= 0) break;
+		done += r;
+	}
+	return done;
 }
 
 static inline size_t x_write(file_t fd, const void* buf, uint64_t start, size_t count){
-	return pwrite(fd, buf, count, start);
+	size_t done = 0;
+	while(done < count){
+		ssize_t r = pwrite(fd, (const char*) buf + done, count - done, start + done);
+		if(r <= 0) break;
+		done += r;
+	}
+	return done;
 }
 
 static inline bool x_setsize(file_t fd, uint64_t sz){
 	return !ftruncate(fd, sz);
 }
 
+static inline bool x_allocate(file_t fd, uint64_t start, uint64_t count){
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	if(!fallocate(fd, 0, start, count)) return true;
+#endif
+	return x_getsize(fd) >= start + count || x_setsize(fd, start + count);
+}
+
+static inline bool x_punch(file_t fd, uint64_t start, uint64_t count){
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	return !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, count);
+#elif defined(F_PUNCHHOLE)
+	fpunchhole_t args = {0, 0, (off_t) start, (off_t) count};
+	return !fcntl(fd, F_PUNCHHOLE, &args);
+#else
+	return false;
+#endif
+}
+
 static inline bool x_flush(file_t fd){ return !fsync(fd); }
+#ifdef __APPLE__
+static inline bool x_datasync(file_t fd){ return !fsync(fd); }
+#else
+static inline bool x_datasync(file_t fd){ return !fdatasync(fd); }
+#endif
 
 static inline void x_close(file_t fd){ close(fd); }
 
@@ -336,4 +470,351 @@ static inline bool x_move(const char* old_name, const char* new_name){
 	return !rename(old_name, new_name);
 }
 
+static inline bool x_syncdir(const char* name){
+	int fd = open(name, O_RDONLY);
+	if(fd < 0) return false;
+	bool ok = !fsync(fd);
+	close(fd);
+	return ok;
+}
+
 #endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <string.h>
+
+static inline bool x_ring_open(x_ring_t* r, unsigned entries){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = -1;
+	int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	if(fd < 0) return false;
+	// IORING_OP_READ/WRITE need 5.6+, as does the probe itself, so an older kernel fails here and we fall back to plain reads and writes
+	uint64_t probe_buf[(sizeof(struct io_uring_probe) + (IORING_OP_WRITE+1)*sizeof(struct io_uring_probe_op))/8];
+	memset(probe_buf, 0, sizeof(probe_buf));
+	struct io_uring_probe* probe = (struct io_uring_probe*) probe_buf;
+	if((int) syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_WRITE+1) < 0 || probe->last_op < IORING_OP_WRITE
+		|| !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) || !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)){
+		close(fd);
+		return false;
+	}
+	size_t sq_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	size_t cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	r->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	r->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+	char* ring = (char*) MAP_FAILED;
+	void* sqes = MAP_FAILED;
+	// Kernels that passed the probe map the SQ and CQ rings together (5.4+), so this only fails on a mismatched header
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ring = (char*) mmap(0, r->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(ring != MAP_FAILED)
+		sqes = mmap(0, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED){
+		if(ring != MAP_FAILED) munmap(ring, r->ring_sz);
+		close(fd);
+		return false;
+	}
+	r->ring = ring;
+	r->sq_head = (unsigned*) (ring + p.sq_off.head);
+	r->sq_tail = (unsigned*) (ring + p.sq_off.tail);
+	r->sq_mask = (unsigned*) (ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*) (ring + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned*) (ring + p.cq_off.head);
+	r->cq_tail = (unsigned*) (ring + p.cq_off.tail);
+	r->cq_mask = (unsigned*) (ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (ring + p.cq_off.cqes);
+	r->sqes = (struct io_uring_sqe*) sqes;
+	r->fd = fd;
+	return true;
+}
+
+static inline void x_ring_close(x_ring_t* r){
+	if(r->fd < 0) return;
+	munmap(r->sqes, r->sqes_sz);
+	munmap(r->ring, r->ring_sz);
+	close(r->fd);
+	r->fd = -1;
+}
+
+static inline bool x_ring_push(x_ring_t* r, x_io_t* io){
+	unsigned tail = *r->sq_tail;
+	if(r->fd < 0 || tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries || io->count > X_RING_MAX) return false;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	io->result = 0;
+	if(io->fd == X_FILE_T_INVALID){
+		sqe->opcode = IORING_OP_NOP;
+	}else{
+		sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = io->fd;
+		sqe->addr = (uint64_t) (uintptr_t) io->buf;
+		sqe->len = (unsigned) io->count;
+		sqe->off = io->start;
+	}
+	sqe->user_data = (uint64_t) (uintptr_t) io;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline bool x_ring_submit(x_ring_t* r){
+	while(r->fd >= 0){
+		unsigned n = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if(!n) return true;
+		// EAGAIN/EBUSY: the kernel is short on resources, the operations stay queued for the next call
+		if((int) syscall(__NR_io_uring_enter, r->fd, n, 0, 0, 0, 0) < 0 && errno != EINTR) return errno == EAGAIN || errno == EBUSY;
+	}
+	return false;
+}
+
+static inline size_t x_ring_reap(x_ring_t* r, x_io_t** done, size_t max, bool wait){
+	size_t k = 0;
+	while(r->fd >= 0){
+		unsigned head = *r->cq_head, ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != ctail && k < max; head++){
+			struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+			x_io_t* io = (x_io_t*) (uintptr_t) cqe->user_data;
+			io->result = cqe->res < 0 || io->fd == X_FILE_T_INVALID ? 0 : cqe->res;
+			done[k++] = io;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		if(k || !wait) break;
+		if((int) syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+	}
+	return k;
+}
+#else
+static inline bool x_ring_open(x_ring_t* r, unsigned entries){ r->fd = -1; return false; }
+static inline void x_ring_close(x_ring_t* r){}
+static inline bool x_ring_push(x_ring_t* r, x_io_t* io){ return false; }
+static inline bool x_ring_submit(x_ring_t* r){ return false; }
+static inline size_t x_ring_reap(x_ring_t* r, x_io_t** done, size_t max, bool wait){ return 0; }
+#endif
+
+static inline size_t x_copy(file_t from, uint64_t from_start, file_t to, uint64_t to_start, size_t count){
+	size_t done = 0;
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	while(done < count){
+		off_t a = from_start + done, b = to_start + done;
+		ssize_t r = copy_file_range(from, &a, to, &b, count - done, 0);
+		if(r < 0 && errno == EINTR) continue;
+		// EXDEV, ENOSYS, EINVAL (e.g some filesystems with O_DIRECT): fall back to reads and writes
+		if(r <= 0) break;
+		done += r;
+	}
+#endif
+	if(done >= count) return done;
+	size_t pages = (count - done < (1 << 20) ? count - done + X_PAGE_SIZE-1 : 1 << 20) / X_PAGE_SIZE;
+	char* buf = (char*) x_pagealloc(pages);
+	if(!buf) return done;
+	while(done < count){
+		size_t n = count - done < pages * X_PAGE_SIZE ? count - done : pages * X_PAGE_SIZE;
+		size_t r = x_read(from, buf, from_start + done, n);
+		if(!r || x_write(to, buf, to_start + done, r) < r) break;
+		done += r;
+		if(r < n) break;
+	}
+	x_pagefree(buf, pages);
+	return done;
+}
+
+static inline void x_batch(x_ring_t* r, x_io_t* ios, size_t n){
+#ifdef __linux__
+	while(r && r->fd >= 0 && n){
+		unsigned tail = *r->sq_tail, mask = *r->sq_mask, k = 0;
+		size_t i = 0;
+		for(; i < n && k < r->sq_entries; i++){
+			x_io_t* io = &ios[i];
+			io->result = 0;
+			if(io->fd == X_FILE_T_INVALID) continue;
+			// sqe->len is 32 bits
+			if(io->count > X_RING_MAX){
+				io->result = io->write ? x_write(io->fd, io->buf, io->start, io->count) : x_read(io->fd, io->buf, io->start, io->count);
+				continue;
+			}
+			unsigned idx = (tail + k++) & mask;
+			struct io_uring_sqe* sqe = &r->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = io->fd;
+			sqe->addr = (uint64_t) (uintptr_t) io->buf;
+			sqe->len = (unsigned) io->count;
+			sqe->off = io->start;
+			sqe->user_data = i;
+			r->sq_array[idx] = idx;
+		}
+		__atomic_store_n(r->sq_tail, tail + k, __ATOMIC_RELEASE);
+		unsigned done = 0;
+		while(done < k){
+			int res = (int) syscall(__NR_io_uring_enter, r->fd, k - done, k - done, IORING_ENTER_GETEVENTS, 0, 0);
+			if(res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+				// Ring is broken, we can't know which operations will still run so retire it and redo everything synchronously
+				x_ring_close(r);
+				break;
+			}
+			unsigned head = *r->cq_head, ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+			for(; head != ctail; head++, done++){
+				struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+				ios[cqe->user_data].result = cqe->res < 0 ? 0 : cqe->res;
+			}
+			__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		}
+		if(done < k) break;
+		ios += i; n -= i;
+	}
+#endif
+	for(size_t i = 0; i < n; i++){
+		x_io_t* io = &ios[i];
+		io->result = io->fd == X_FILE_T_INVALID ? 0 : io->write ? x_write(io->fd, io->buf, io->start, io->count) : x_read(io->fd, io->buf, io->start, io->count);
+	}
+}
+
+// CRC32C, shared by all platforms. State is kept inverted (reflected bit order, as in the instructions), see x_crc32c()
+#include <string.h>
+#define X_CRC32C_POLY 0x82F63B78u
+static const uint32_t X_CRC32C_TABLE[256] = {
+	0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C, 0x26A1E7E8, 0xD4CA64EB,
+	0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B, 0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24,
+	0x105EC76F, 0xE235446C, 0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+	0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC, 0xBC267848, 0x4E4DFB4B,
+	0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A, 0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35,
+	0xAA64D611, 0x580F5512, 0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+	0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD, 0x1642AE59, 0xE4292D5A,
+	0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A, 0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595,
+	0x417B1DBC, 0xB3109EBF, 0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+	0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F, 0xED03A29B, 0x1F682198,
+	0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927, 0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38,
+	0xDBFC821C, 0x2997011F, 0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+	0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E, 0x4767748A, 0xB50CF789,
+	0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859, 0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46,
+	0x7198540D, 0x83F3D70E, 0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+	0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE, 0xDDE0EB2A, 0x2F8B6829,
+	0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C, 0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93,
+	0x082F63B7, 0xFA44E0B4, 0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+	0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B, 0xB4091BFF, 0x466298FC,
+	0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C, 0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033,
+	0xA24BB5A6, 0x502036A5, 0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+	0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975, 0x0E330A81, 0xFC588982,
+	0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D, 0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622,
+	0x38CC2A06, 0xCAA7A905, 0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+	0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8, 0xE52CC12C, 0x1747422F,
+	0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF, 0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0,
+	0xD3D3E1AB, 0x21B862A8, 0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+	0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78, 0x7FAB5E8C, 0x8DC0DD8F,
+	0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE, 0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1,
+	0x69E9F0D5, 0x9B8273D6, 0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+	0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
+	0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E, 0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
+static inline uint32_t x_crc32c_sw(uint32_t crc, const uint8_t* p, size_t n){
+	while(n--) crc = X_CRC32C_TABLE[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+// (a * b) mod P. The CRC of `n` zero bytes from state `s` is s * x^(8n) mod P, which is how independently computed CRCs of consecutive chunks are combined
+static inline uint32_t x_crc32c_mul_sw(uint32_t a, uint32_t b){
+	uint32_t m = (uint32_t) 1 << 31, p = 0;
+	for(;;){
+		if(a & m){
+			p ^= b;
+			if(!(a & (m-1))) break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ X_CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+// Large inputs are split in 3 lanes checksummed in parallel, as the CRC instructions have a latency of 3 cycles but a throughput of 1 per cycle
+// x^(8 * X_CRC32C_SHORT) mod P and so on, for shifting lanes into place
+#define X_CRC32C_SHORT 256
+#define X_CRC32C_LONG 8192
+static const uint32_t X_CRC32C_SHIFT_SHORT[2] = {0x88E56F72u, 0x74C360A4u}, X_CRC32C_SHIFT_LONG[2] = {0x28461564u, 0xBF455269u};
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(_MSC_VER))
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define X_CRC32C_TARGET
+static inline bool x_crc32c_hw_ok(void){
+	// SSE4.2 and PCLMULQDQ. The result never changes, so racing threads store the same value
+	static volatile int ok = -1;
+	if(ok < 0){
+		int info[4];
+		__cpuid(info, 1);
+		ok = (info[2] >> 20 & 1) && (info[2] >> 1 & 1);
+	}
+	return ok;
+}
+#else
+#define X_CRC32C_TARGET __attribute__((target("sse4.2,pclmul")))
+static inline bool x_crc32c_hw_ok(void){ return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"); }
+#endif
+X_CRC32C_TARGET static inline uint32_t x_crc32c_mul_hw(uint32_t a, uint32_t b){
+	uint64_t v = (uint64_t) _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi32_si128((int) a), _mm_cvtsi32_si128((int) b), 0)) << 1;
+	return _mm_crc32_u32(0, (uint32_t) v) ^ (uint32_t) (v >> 32);
+}
+X_CRC32C_TARGET static inline uint32_t x_crc32c_hw(uint32_t crc, const uint8_t* p, size_t n){
+	uint64_t c0 = crc;
+	for(size_t lane = X_CRC32C_LONG, k = 1; k <= 2; lane = X_CRC32C_SHORT, k++){
+		const uint32_t* shift = k == 1 ? X_CRC32C_SHIFT_LONG : X_CRC32C_SHIFT_SHORT;
+		for(; n >= lane*3; p += lane*3, n -= lane*3){
+			uint64_t c1 = 0, c2 = 0, a, b, c;
+			for(size_t i = 0; i < lane; i += 8){
+				memcpy(&a, p + i, 8);
+				memcpy(&b, p + lane + i, 8);
+				memcpy(&c, p + lane*2 + i, 8);
+				c0 = _mm_crc32_u64(c0, a);
+				c1 = _mm_crc32_u64(c1, b);
+				c2 = _mm_crc32_u64(c2, c);
+			}
+			c0 = x_crc32c_mul_hw(shift[1], (uint32_t) c0) ^ x_crc32c_mul_hw(shift[0], (uint32_t) c1) ^ (uint32_t) c2;
+		}
+	}
+	for(uint64_t v; n >= 8; p += 8, n -= 8){
+		memcpy(&v, p, 8);
+		c0 = _mm_crc32_u64(c0, v);
+	}
+	uint32_t c = (uint32_t) c0;
+	while(n--) c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+#define X_CRC32C_HW 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+static inline bool x_crc32c_hw_ok(void){ return true; }
+static inline uint32_t x_crc32c_hw(uint32_t crc, const uint8_t* p, size_t n){
+	uint32_t c0 = crc;
+	// Without PMULL, lanes are only worth combining when they are long
+	for(; n >= X_CRC32C_LONG*3; p += X_CRC32C_LONG*3, n -= X_CRC32C_LONG*3){
+		uint32_t c1 = 0, c2 = 0;
+		uint64_t a, b, c;
+		for(size_t i = 0; i < X_CRC32C_LONG; i += 8){
+			memcpy(&a, p + i, 8);
+			memcpy(&b, p + X_CRC32C_LONG + i, 8);
+			memcpy(&c, p + X_CRC32C_LONG*2 + i, 8);
+			c0 = __crc32cd(c0, a);
+			c1 = __crc32cd(c1, b);
+			c2 = __crc32cd(c2, c);
+		}
+		c0 = x_crc32c_mul_sw(X_CRC32C_SHIFT_LONG[1], c0) ^ x_crc32c_mul_sw(X_CRC32C_SHIFT_LONG[0], c1) ^ c2;
+	}
+	for(uint64_t v; n >= 8; p += 8, n -= 8){
+		memcpy(&v, p, 8);
+		c0 = __crc32cd(c0, v);
+	}
+	while(n--) c0 = __crc32cb(c0, *p++);
+	return c0;
+}
+#define X_CRC32C_HW 1
+#endif
+
+static inline uint32_t x_crc32c(uint32_t crc, const void* buf, size_t count){
+	const uint8_t* p = (const uint8_t*) buf;
+#ifdef X_CRC32C_HW
+	if(x_crc32c_hw_ok()) return ~x_crc32c_hw(~crc, p, count);
+#endif
+	return ~x_crc32c_sw(~crc, p, count);
+}